@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace Pizza
+{
+  // Storage for array toppings. An array lives until the scope that
+  // declares it ends, so arrays are freed in the reverse order they were
+  // made: allocating bumps an offset through a list of chunks, and
+  // release() moves it back to where it was at a mark(). Chunks are kept
+  // once allocated, so a loop that declares an array reuses the same memory
+  // on every iteration.
+  class Arena
+  {
+  public:
+    // Arrays start on a cache line, which is also enough for any vector
+    // load.
+    static const size_t Alignment = 64;
+
+    // Returns Bytes of zeroed memory, or null if there isn't enough.
+    void *allocate(size_t Bytes);
+
+    // The number of live allocations. release(Mark) frees everything
+    // allocated since mark() returned Mark.
+    size_t mark() const { return Live.size(); }
+    void release(size_t Mark);
+
+  private:
+    static const size_t MinChunkSize = size_t(1) << 20;
+
+    struct Chunk
+    {
+      std::unique_ptr<char[]> Storage;
+      char *Begin; // Storage rounded up to Alignment.
+      size_t Size;
+    };
+
+    struct Position
+    {
+      size_t Chunk;
+      size_t Offset;
+    };
+
+    std::vector<Chunk> Chunks;
+    Position Top = {0, 0};
+    // Where Top was before each live allocation.
+    std::vector<Position> Live;
+
+    void *take(size_t Chunk, size_t Offset, size_t Bytes);
+  };
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string>
+#include <vector>
+
 namespace Pizza
 {
   namespace AST
@@ -7,9 +10,42 @@ namespace Pizza
     struct Options
     {
       bool repl;
+      bool benchLexer;
+      bool benchJson;
+      bool parallelParse;
+      // '0'..'3' or 's' for -O0..-O3/-Os, 0 when no -O was given.
+      char optLevel;
+      bool fastCompile;
+      bool timeCompile;
+      // --precision=f32: numbers are floats instead of doubles.
+      bool singlePrecision;
+      // --whole-program: compile every item into one module before running
+      // any of them.
+      bool wholeProgram;
+      // --memoize[=base,...]: cache the results of pure bases, either the
+      // listed ones or all that call other bases.
+      bool memoize;
+      std::vector<std::string> memoizeBases;
+      // --stats: report memo table hit rates on exit.
+      bool stats;
+      // --batch: add a vectorized name__batch entry point to each base that
+      // can have one.
+      bool batch;
+      // --march=cpu and --mattr=+feature,-feature: the CPU the JIT compiles
+      // for instead of the host's.
+      std::string march;
+      std::string mattr;
+      // --target-clones=feature,...: the llPath output has a version of each
+      // base per listed x86 feature, picked by the loader.
+      std::vector<std::string> targetClones;
+      // --spawn-depth=N: calls spawned more than N levels deep are plain
+      // calls, so N=0 runs everything on one thread. Negative picks a depth
+      // from the core count.
+      int spawnDepth;
       std::string srcPath;
       std::string jsonPath;
       std::string llPath;
+      std::string astCacheDir;
     };
     int Run(const struct Options &opt);
   }
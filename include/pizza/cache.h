@@ -0,0 +1,98 @@
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <cstdint>
+#include <memory>
+
+#include "pizza/symbols.h"
+#include "pizza/tree.h"
+
+namespace Pizza
+{
+  namespace AST
+  {
+    // A parsed top-level item as stored in an AST cache. Args is a range of
+    // the cache's argument symbols and Errors a range of its diagnostic text:
+    // whatever the parser printed for the item, so a cached run reports the
+    // same errors.
+    struct CachedItem
+    {
+      enum ItemKind : uint8_t
+      {
+        Invalid,
+        Definition,
+        Extern,
+        Expression
+      };
+
+      ItemKind Kind;
+      bool IsOperator;
+      uint32_t Precedence;
+      Symbol Name;
+      ListRef Args;
+      ExprRef Body;
+      ListRef Errors;
+    };
+
+    // What a cache file must match to be used: the source it was parsed from
+    // and the operator precedences the parse started with.
+    struct CacheKey
+    {
+      uint64_t SourceHash;
+      uint64_t SourceSize;
+      int32_t Precedence[128];
+    };
+
+    // Every item of one source file together with the Tree they point into,
+    // in a versioned binary form that is mapped back in without decoding:
+    // the node arrays of a loaded cache are views of the mapped file.
+    //
+    // Symbols are stored by name and re-interned on load. Loading only
+    // succeeds if that gives every symbol the ID it had when the file was
+    // written, which holds as long as the cache is loaded before anything
+    // else is lexed.
+    class ASTCache
+    {
+    private:
+      std::unique_ptr<llvm::MemoryBuffer> Buffer;
+      Tree ASTTree;
+      Column<CachedItem> Items;
+      Column<Symbol> Args;
+      Column<char> Errors;
+
+    public:
+      static const uint32_t Version = 5;
+
+      Tree &getTree() { return ASTTree; }
+      const Tree &getTree() const { return ASTTree; }
+
+      llvm::ArrayRef<CachedItem> items() const { return Items.items(); }
+      llvm::ArrayRef<Symbol> getArgs(const CachedItem &Item) const
+      {
+        return Args.items().slice(Item.Args.Begin, Item.Args.Size);
+      }
+      llvm::StringRef getErrors(const CachedItem &Item) const
+      {
+        return llvm::StringRef(Errors.items().data() + Item.Errors.Begin,
+                               Item.Errors.Size);
+      }
+
+      void addItem(CachedItem Item, llvm::ArrayRef<Symbol> ItemArgs,
+                   llvm::StringRef ItemErrors);
+
+      // Writes the cache to Path through a temporary file, so readers never
+      // see a partial one. Returns false on I/O errors.
+      bool write(llvm::StringRef Path, const CacheKey &Key,
+                 const SymbolTable &Symbols) const;
+
+      // Maps Path and returns its contents, or null if there is no usable
+      // cache there: missing, truncated, another version or key.
+      static std::unique_ptr<ASTCache> load(llvm::StringRef Path,
+                                            const CacheKey &Key,
+                                            SymbolTable &Symbols);
+    };
+  }
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/ExecutionEngine/JITSymbol.h>
 #include <llvm/ExecutionEngine/Orc/CompileUtils.h>
@@ -12,6 +14,9 @@
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Target/TargetMachine.h>
 
 #include <algorithm>
 #include <map>
@@ -31,6 +36,7 @@ namespace Pizza
         std::unique_ptr<llvm::orc::ExecutionSession> ES;
 
         llvm::DataLayout DL;
+        llvm::orc::JITTargetMachineBuilder TMBuilder;
         llvm::orc::MangleAndInterner Mangle;
 
         llvm::orc::RTDyldObjectLinkingLayer ObjectLayer;
@@ -43,7 +49,7 @@ namespace Pizza
             std::unique_ptr<llvm::orc::ExecutionSession> ES,
             llvm::orc::JITTargetMachineBuilder JTMB, llvm::DataLayout DL)
             : TPC(std::move(TPC)), ES(std::move(ES)), DL(std::move(DL)),
-              Mangle(*this->ES, this->DL),
+              TMBuilder(JTMB), Mangle(*this->ES, this->DL),
               ObjectLayer(*this->ES,
                           []()
                           { return std::make_unique<llvm::SectionMemoryManager>(); }),
@@ -62,7 +68,13 @@ namespace Pizza
                 ES->reportError(std::move(Err));
         }
 
-        static llvm::Expected<std::unique_ptr<JIT>> Create()
+        // Code is tuned for the host CPU and may use all of its features,
+        // unless CPU names another one. Features ("+avx2,-fma") then adjust
+        // that CPU's feature set.
+        static llvm::Expected<std::unique_ptr<JIT>> Create(llvm::CodeGenOpt::Level OptLevel = llvm::CodeGenOpt::Default,
+                                                           bool FastISel = false,
+                                                           llvm::StringRef CPU = "",
+                                                           llvm::StringRef Features = "")
         {
             auto SSP = std::make_shared<llvm::orc::SymbolStringPool>();
             auto TPC = llvm::orc::SelfTargetProcessControl::Create(SSP);
@@ -72,6 +84,34 @@ namespace Pizza
             auto ES = std::make_unique<llvm::orc::ExecutionSession>(std::move(SSP));
 
             llvm::orc::JITTargetMachineBuilder JTMB((*TPC)->getTargetTriple());
+            JTMB.setCodeGenOptLevel(OptLevel);
+            JTMB.getOptions().EnableFastISel = FastISel;
+
+            if (CPU.empty())
+            {
+                JTMB.setCPU(llvm::sys::getHostCPUName().str());
+                llvm::StringMap<bool> HostFeatures;
+                if (llvm::sys::getHostCPUFeatures(HostFeatures))
+                    for (auto &Feature : HostFeatures)
+                        JTMB.getFeatures().AddFeature(Feature.first(), Feature.second);
+            }
+            else
+            {
+                // LLVM only warns about a CPU it doesn't know, and then fails
+                // in the backend.
+                auto TM = JTMB.createTargetMachine();
+                if (!TM)
+                    return TM.takeError();
+                if (!(*TM)->getMCSubtargetInfo()->isCPUStringValid(CPU))
+                    return llvm::make_error<llvm::StringError>("unknown CPU '" + CPU + "'",
+                                                               llvm::inconvertibleErrorCode());
+                JTMB.setCPU(CPU.str());
+            }
+
+            llvm::SmallVector<llvm::StringRef, 8> ExtraFeatures;
+            Features.split(ExtraFeatures, ',', -1, /*KeepEmpty=*/false);
+            for (llvm::StringRef Feature : ExtraFeatures)
+                JTMB.getFeatures().AddFeature(Feature);
 
             auto DL = JTMB.getDefaultDataLayoutForTarget();
             if (!DL)
@@ -85,6 +125,13 @@ namespace Pizza
 
         llvm::orc::JITDylib &getMainJITDylib() { return MainJD; }
 
+        // A TargetMachine configured like the one the JIT compiles with, for
+        // target-aware IR optimization.
+        llvm::Expected<std::unique_ptr<llvm::TargetMachine>> createTargetMachine()
+        {
+            return TMBuilder.createTargetMachine();
+        }
+
         llvm::Error addModule(llvm::orc::ThreadSafeModule TSM, llvm::orc::ResourceTrackerSP RT = nullptr)
         {
             if (!RT)
@@ -92,6 +139,21 @@ namespace Pizza
             return CompileLayer.add(RT, std::move(TSM));
         }
 
+        // Binds Name to a host address, for data compiled code refers to by
+        // name.
+        llvm::Error defineAbsolute(llvm::StringRef Name, const void *Addr)
+        {
+            return MainJD.define(llvm::orc::absoluteSymbols(
+                {{Mangle(Name.str()),
+                  llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(Addr),
+                                           llvm::JITSymbolFlags::Exported)}}));
+        }
+
+        llvm::Error remove(llvm::StringRef Name)
+        {
+            return MainJD.remove({Mangle(Name.str())});
+        }
+
         llvm::Expected<llvm::JITEvaluatedSymbol> lookup(llvm::StringRef Name)
         {
             return ES->lookup({&MainJD}, Mangle(Name.str()));
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+
+#include "pizza/source.h"
+#include "pizza/symbols.h"
+
+namespace Pizza
+{
+  enum Token
+  {
+    tok_eof = -1,
+    tok_base = -2,
+    tok_topping = -3,
+    tok_identifier = -4,
+    tok_number = -5,
+    tok_sauce = -6,
+    tok_if = -7,
+    tok_then = -8,
+    tok_else = -9,
+    tok_for = -10,
+    tok_in = -11,
+    tok_binary = -12,
+    tok_unary = -13,
+    tok_spawn = -14,
+    tok_sync = -15
+  };
+
+  class Lexer
+  {
+  private:
+    Source &Src;
+    SymbolTable &Symbols;
+    const char *TokStart;
+    const char *CurPtr;
+    Symbol IdentifierSym = NoSymbol;
+    double NumVal = 0;
+
+    int peekChar();
+    void skipTrivia();
+
+  public:
+    Lexer(Source &Src, SymbolTable &Symbols)
+        : Src(Src), Symbols(Symbols), TokStart(Src.begin()), CurPtr(Src.begin()) {}
+
+    int gettok();
+
+    // Interned name of the last tok_identifier.
+    Symbol getIdentifier() const { return IdentifierSym; }
+    double getNumVal() const { return NumVal; }
+  };
+
+  // Splits [Begin, End) right after ';' characters that are outside of any
+  // (), {} and comments, so every piece holds whole top-level items. Pieces
+  // are at least MinSize bytes except the last. Returns the end of each
+  // piece; that is just {End} when the input defines an operator on one of
+  // ;(){} and can't be split safely.
+  std::vector<const char *> splitTopLevelItems(const char *Begin, const char *End,
+                                               size_t MinSize);
+}
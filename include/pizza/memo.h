@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Pizza
+{
+  // Results of one memoized base, keyed on the bit patterns of its
+  // arguments. A fixed-size open-addressing table: a key probes a few slots
+  // from its hash, and when they all hold other keys the new result
+  // replaces the first of them, so memory use never grows.
+  class MemoTable
+  {
+  private:
+    static const unsigned LogCapacity = 16;
+    static const unsigned MaxProbes = 8;
+
+    unsigned NumArgs;
+    std::vector<uint64_t> Keys; // NumArgs per slot.
+    std::vector<double> Values;
+    std::vector<uint8_t> Used;
+    uint64_t Calls = 0;
+    uint64_t Hits = 0;
+
+    size_t hash(const double *Args) const;
+    bool matches(size_t Slot, const double *Args) const;
+
+  public:
+    explicit MemoTable(unsigned NumArgs);
+
+    // Returns the cached result for Args, or null.
+    const double *lookup(const double *Args);
+    void store(const double *Args, double Value);
+
+    uint64_t calls() const { return Calls; }
+    uint64_t hits() const { return Hits; }
+  };
+}
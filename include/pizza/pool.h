@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Pizza
+{
+  // Threads that run the chunks of a parallel for, as many as there are
+  // cores counting the one that starts the loop. Each thread gets an equal,
+  // contiguous share of the chunks and works through it from the front; a
+  // thread that runs out steals the back half of the largest share left,
+  // so uneven chunks even out without a queue every thread contends on.
+  class WorkPool
+  {
+  public:
+    typedef void (*ChunkFn)(void *Ctx, uint32_t Chunk);
+
+    // Threads includes the caller of run(); the pool starts the others.
+    explicit WorkPool(unsigned Threads);
+    ~WorkPool();
+
+    // Calls Fn on every chunk below NumChunks and returns once they have
+    // all finished. One loop runs at a time: a chunk that starts another
+    // has to run it itself.
+    void run(uint32_t NumChunks, ChunkFn Fn, void *Ctx);
+
+    // Whether the calling thread is in the middle of a chunk.
+    static bool inChunk();
+
+  private:
+    // The chunks a thread has left, first << 32 | end, so that taking one
+    // from the front and stealing from the back are both a single
+    // compare-and-swap. Padded so each share has its own cache line.
+    struct Share
+    {
+      std::atomic<uint64_t> Range;
+      char Padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::vector<Share> Shares;
+    std::vector<std::thread> Workers;
+
+    std::mutex Lock;
+    std::condition_variable Started, Finished;
+    // Counts the loops run, so a worker can tell a new one started.
+    uint64_t Loop = 0;
+    // Workers not done with the current loop yet.
+    unsigned Running = 0;
+    bool Stopping = false;
+    ChunkFn Fn = nullptr;
+    void *Ctx = nullptr;
+
+    void work(unsigned Self);
+    void runChunks(unsigned Self);
+    bool next(unsigned Self, uint32_t &Chunk);
+  };
+}
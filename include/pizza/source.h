@@ -0,0 +1,48 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <string>
+
+namespace Pizza
+{
+  // Input layer for the lexer. Files are memory-mapped (through
+  // llvm::MemoryBuffer) and exposed as a single window; stdin is read in large
+  // blocks so the REPL still sees input line by line as it is typed.
+  //
+  // stdin has a single block that is reused for every read, so pointers into
+  // the window are only valid until the next refill(); anything the lexer
+  // still needs is carried over through Keep.
+  class Source
+  {
+  private:
+    std::unique_ptr<llvm::MemoryBuffer> File;
+    std::unique_ptr<char[]> Block;
+    size_t BlockCapacity = 0;
+    bool LastReadFull = false;
+    const char *Begin = nullptr;
+    const char *End = nullptr;
+    bool AtEOF = false;
+
+  public:
+    static const size_t BlockSize = 64 * 1024;
+    static const size_t LineBlockSize = 4 * 1024;
+
+    static std::unique_ptr<Source> openFile(const std::string &Path);
+    static std::unique_ptr<Source> openStdin();
+    // View of [Begin, End) of a buffer owned by another Source.
+    static std::unique_ptr<Source> openRange(const char *Begin, const char *End);
+
+    // Current window. *end() is '\0' except for ranges.
+    const char *begin() const { return Begin; }
+    const char *end() const { return End; }
+    size_t size() const { return End - Begin; }
+
+    // Reads the next block. The bytes in [Keep, end()) are carried over to the
+    // start of the new window and Keep is updated to point at them, even when
+    // no more input is available and false is returned.
+    bool refill(const char *&Keep);
+  };
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/RWMutex.h>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Pizza
+{
+  // Interned identifier: equal spellings get equal IDs, so names are compared
+  // and hashed as plain integers.
+  typedef uint32_t Symbol;
+
+  const Symbol NoSymbol = ~0u;
+
+  // Owns the spelling of every identifier the lexer has seen and hands out
+  // dense IDs for them. IDs and spellings stay valid for the lifetime of the
+  // table. Safe to use from several threads, which --parallel-parse does.
+  class SymbolTable
+  {
+  private:
+    llvm::StringMap<Symbol, llvm::BumpPtrAllocator> Ids;
+    std::vector<llvm::StringRef> Names;
+    mutable llvm::sys::SmartRWMutex<true> Mutex;
+
+  public:
+    Symbol intern(llvm::StringRef Name);
+    llvm::StringRef name(Symbol S) const;
+    // Number of symbols; IDs are 0 .. size() - 1 in interning order.
+    size_t size() const;
+  };
+
+  // Symbol-keyed bindings with nested scopes. All scopes share one map plus
+  // an undo log: bind() records the value a name had before, and exitScope()
+  // puts back only what the scope changed, so entering and leaving a scope
+  // costs nothing beyond the bindings it introduced. A default-constructed
+  // ValueT means "unbound".
+  template <typename ValueT>
+  class ScopedSymbolTable
+  {
+  private:
+    llvm::DenseMap<Symbol, ValueT> Values;
+    llvm::SmallVector<std::pair<Symbol, ValueT>, 16> Shadowed;
+    llvm::SmallVector<size_t, 8> Scopes;
+
+  public:
+    ValueT lookup(Symbol Name) const { return Values.lookup(Name); }
+    bool empty() const { return Values.empty(); }
+
+    void bind(Symbol Name, ValueT Value)
+    {
+      ValueT &Slot = Values[Name];
+      Shadowed.push_back({Name, Slot});
+      Slot = Value;
+    }
+
+    void enterScope() { Scopes.push_back(Shadowed.size()); }
+
+    void exitScope()
+    {
+      size_t Mark = Scopes.pop_back_val();
+      while (Shadowed.size() > Mark)
+      {
+        auto Entry = Shadowed.pop_back_val();
+        if (Entry.second)
+          Values[Entry.first] = Entry.second;
+        else
+          Values.erase(Entry.first);
+      }
+    }
+  };
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Pizza
+{
+  // What a base that spawns keeps in its frame: how many of its spawns are
+  // still queued or running, and the spawn depth of its thread before its
+  // first spawn since the last sync, or -1 if there was none. Compiled code
+  // lays it out as { i64, i64 } starting at { 0, -1 }.
+  struct TaskGroup
+  {
+    std::atomic<int64_t> Pending;
+    int64_t Entry;
+  };
+  static_assert(sizeof(std::atomic<int64_t>) == sizeof(int64_t),
+                "TaskGroup must match its layout in compiled code");
+
+  // Threads that run spawned calls, one per core counting the one that
+  // starts the program. Each has a deque of the calls it spawned: it pushes
+  // and pops at the bottom, newest first, while idle threads steal the
+  // oldest, and so largest, calls from the top. Taking from a deque is a
+  // compare-and-swap only when the owner and a thief go for its last call.
+  //
+  // A spawn takes both the call and the spawner's continuation one level
+  // deeper, so in a recursive base the levels follow the recursion. Past
+  // MaxDepth the calls are too small to be worth a task and run as plain
+  // calls instead.
+  class TaskPool
+  {
+  public:
+    typedef void (*RunFn)(void *Args, void *Dest);
+
+    // Threads includes the caller of the constructor, which becomes the
+    // pool's first thread; the pool starts the others.
+    TaskPool(unsigned Threads, unsigned MaxDepth);
+    ~TaskPool();
+
+    // Queues Run(copy of the Size bytes at Args, Dest) as part of Group.
+    // Returns false, queueing nothing, when the call should run right away
+    // in the caller instead: too deep, a full deque, or a thread that isn't
+    // one of the pool's.
+    bool spawn(TaskGroup &Group, RunFn Run, const void *Args, size_t Size, void *Dest);
+
+    // Returns once every call spawned in Group has finished, running queued
+    // calls meanwhile.
+    void sync(TaskGroup &Group);
+
+    // Whether the calling thread is one the pool started, as opposed to
+    // the one that made it.
+    static bool onWorker();
+
+  private:
+    struct Task
+    {
+      RunFn Run;
+      void *Dest;
+      TaskGroup *Group;
+      int64_t Depth;
+      // The arguments follow.
+      void *args() { return this + 1; }
+    };
+
+    // A Chase-Lev deque of fixed capacity. Padded so the owner's index and
+    // the thieves' are on cache lines of their own.
+    class Deque
+    {
+    public:
+      static const int64_t Capacity = 1024;
+
+      bool push(Task *T);
+      Task *pop();
+      Task *steal();
+      bool empty() const;
+
+    private:
+      std::atomic<int64_t> Top{0};
+      char TopPadding[64 - sizeof(std::atomic<int64_t>)];
+      std::atomic<int64_t> Bottom{0};
+      char BottomPadding[64 - sizeof(std::atomic<int64_t>)];
+      std::atomic<Task *> Slots[Capacity];
+    };
+
+    std::vector<std::unique_ptr<Deque>> Deques;
+    std::vector<std::thread> Workers;
+    const int64_t MaxDepth;
+
+    // Idle workers sleep on Woken until Epoch moves; spawns only take the
+    // lock when some are Sleeping.
+    std::mutex Lock;
+    std::condition_variable Woken;
+    uint64_t Epoch = 0;
+    std::atomic<unsigned> Sleeping{0};
+    std::atomic<bool> Stopping{false};
+
+    void work(unsigned Self);
+    void run(Task *T);
+    Task *stealAny();
+    bool anyQueued() const;
+  };
+}
@@ -0,0 +1,469 @@
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Support/ErrorHandling.h>
+
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "pizza/symbols.h"
+
+namespace Pizza
+{
+  namespace AST
+  {
+    enum class ExprKind : uint8_t
+    {
+      Number,
+      Variable,
+      Binary,
+      Unary,
+      Call,
+      If,
+      For,
+      Var,
+      Scope,
+      Index,
+      Spawn,
+      Sync
+    };
+
+    // 32-bit reference to an expression node: the kind in the top 4 bits and
+    // the index into that kind's node array in the low 28. A default
+    // constructed ExprRef is null, which is how the parser reports errors and
+    // how optional children (a for's step, a topping's initializer) are left
+    // out.
+    class ExprRef
+    {
+    private:
+      static const uint32_t IndexBits = 28;
+      static const uint32_t NullBits = ~0u;
+      uint32_t Bits = NullBits;
+
+    public:
+      static const uint32_t MaxIndex = (1u << IndexBits) - 1;
+
+      ExprRef() = default;
+      ExprRef(ExprKind Kind, uint32_t Index)
+          : Bits(((uint32_t)Kind << IndexBits) | Index) {}
+
+      ExprKind getKind() const { return (ExprKind)(Bits >> IndexBits); }
+      uint32_t getIndex() const { return Bits & MaxIndex; }
+      uint32_t getRaw() const { return Bits; }
+
+      explicit operator bool() const { return Bits != NullBits; }
+      bool operator==(ExprRef Other) const { return Bits == Other.Bits; }
+      bool operator!=(ExprRef Other) const { return Bits != Other.Bits; }
+    };
+
+    // A run of entries in one of the Tree's shared side arrays.
+    struct ListRef
+    {
+      uint32_t Begin = 0;
+      uint32_t Size = 0;
+    };
+
+    struct NumberExpr
+    {
+      double Val;
+    };
+
+    struct VariableExpr
+    {
+      Symbol Name;
+    };
+
+    struct BinaryExpr
+    {
+      char Op;
+      ExprRef LHS, RHS;
+    };
+
+    struct UnaryExpr
+    {
+      char Opcode;
+      ExprRef Operand;
+    };
+
+    struct CallExpr
+    {
+      Symbol Callee;
+      ListRef Args;
+    };
+
+    struct IfExpr
+    {
+      ExprRef Cond, Then, Else;
+    };
+
+    // What a for evaluates to: the value of its last iteration, or the
+    // body values of every iteration combined. Sum and product may combine
+    // them in any order, so they can round differently from a left-to-right
+    // loop; min and max leave the result unspecified when a value is NaN,
+    // and which zero they return when both are seen. In exchange the loops
+    // can be vectorized.
+    enum class Reduction : uint8_t
+    {
+      None,
+      Sum,
+      Product,
+      Min,
+      Max
+    };
+
+    struct ForExpr
+    {
+      Symbol VarName;
+      ExprRef Start, End, Step, Body;
+      Reduction Reduce;
+      // Iterations may run at the same time, on several threads.
+      bool Parallel;
+    };
+
+    // A topping is either a number, with an optional Init, or an array of
+    // Length numbers, all zero to start with.
+    struct VarBinding
+    {
+      Symbol Name;
+      ExprRef Init;
+      ExprRef Length;
+    };
+
+    struct VarExpr
+    {
+      ListRef Bindings;
+      ExprRef Body;
+    };
+
+    struct ScopeExpr
+    {
+      ListRef Body;
+    };
+
+    // An element of an array topping: the value of Array[Index], or the
+    // destination of an '='.
+    struct IndexExpr
+    {
+      Symbol Array;
+      ExprRef Index;
+    };
+
+    // A call that may run on another thread while the base that spawned it
+    // goes on; its result lands in the topping or array element it is
+    // assigned to by the next sync.
+    struct SpawnExpr
+    {
+      ExprRef Call;
+    };
+
+    // Waits for everything the base spawned so far.
+    struct SyncExpr
+    {
+    };
+
+    template <typename T>
+    struct NodeKind;
+#define PIZZA_NODE_KIND(T, K)                  \
+  template <>                                  \
+  struct NodeKind<T>                           \
+  {                                            \
+    static const ExprKind Kind = ExprKind::K;  \
+  };
+    PIZZA_NODE_KIND(NumberExpr, Number)
+    PIZZA_NODE_KIND(VariableExpr, Variable)
+    PIZZA_NODE_KIND(BinaryExpr, Binary)
+    PIZZA_NODE_KIND(UnaryExpr, Unary)
+    PIZZA_NODE_KIND(CallExpr, Call)
+    PIZZA_NODE_KIND(IfExpr, If)
+    PIZZA_NODE_KIND(ForExpr, For)
+    PIZZA_NODE_KIND(VarExpr, Var)
+    PIZZA_NODE_KIND(ScopeExpr, Scope)
+    PIZZA_NODE_KIND(IndexExpr, Index)
+    PIZZA_NODE_KIND(SpawnExpr, Spawn)
+    PIZZA_NODE_KIND(SyncExpr, Sync)
+#undef PIZZA_NODE_KIND
+
+    // One of the Tree's arrays. It either owns its elements or views memory
+    // owned elsewhere (a mapped AST cache); adding to a view copies it first.
+    template <typename T>
+    class Column
+    {
+    private:
+      std::vector<T> Owned;
+      llvm::ArrayRef<T> Items;
+
+      void own()
+      {
+        if (Items.data() != Owned.data())
+          Owned.assign(Items.begin(), Items.end());
+      }
+
+    public:
+      typedef T value_type;
+
+      llvm::ArrayRef<T> items() const { return Items; }
+
+      uint32_t push(const T &Item)
+      {
+        own();
+        Owned.push_back(Item);
+        Items = Owned;
+        return Owned.size() - 1;
+      }
+
+      uint32_t push(llvm::ArrayRef<T> New)
+      {
+        own();
+        uint32_t Begin = Owned.size();
+        Owned.insert(Owned.end(), New.begin(), New.end());
+        Items = Owned;
+        return Begin;
+      }
+
+      void view(llvm::ArrayRef<T> External)
+      {
+        Owned.clear();
+        Items = External;
+      }
+
+      void clear()
+      {
+        Owned.clear();
+        Items = Owned;
+      }
+    };
+
+    // Expression nodes of one or more top-level items, stored by kind in
+    // contiguous arrays. Nodes are plain structs that refer to each other by
+    // ExprRef, so clear() releases a whole tree at once and keeps the
+    // capacity for the next item, and a tree can be written out and mapped
+    // back in as is.
+    class Tree
+    {
+    private:
+      std::tuple<Column<NumberExpr>, Column<VariableExpr>,
+                 Column<BinaryExpr>, Column<UnaryExpr>,
+                 Column<CallExpr>, Column<IfExpr>,
+                 Column<ForExpr>, Column<VarExpr>,
+                 Column<ScopeExpr>, Column<IndexExpr>,
+                 Column<SpawnExpr>, Column<SyncExpr>, Column<ExprRef>,
+                 Column<VarBinding>>
+          Columns;
+
+      template <typename T>
+      Column<T> &column() { return std::get<Column<T>>(Columns); }
+      template <typename T>
+      const Column<T> &column() const { return std::get<Column<T>>(Columns); }
+
+      template <typename TupleT, typename FnT, size_t... I>
+      static void forEachColumn(TupleT &Cols, FnT &Fn, std::index_sequence<I...>)
+      {
+        (void)std::initializer_list<int>{(Fn(std::get<I>(Cols)), 0)...};
+      }
+
+    public:
+      static const size_t NumColumns = std::tuple_size<decltype(Columns)>::value;
+
+      template <typename T>
+      ExprRef add(const T &Node)
+      {
+        if (column<T>().items().size() > ExprRef::MaxIndex)
+          llvm::report_fatal_error("too many expression nodes in one tree");
+        return ExprRef(NodeKind<T>::Kind, column<T>().push(Node));
+      }
+
+      template <typename T>
+      const T &get(ExprRef E) const
+      {
+        assert(E && E.getKind() == NodeKind<T>::Kind && "wrong node kind");
+        return column<T>().items()[E.getIndex()];
+      }
+
+      ListRef addList(llvm::ArrayRef<ExprRef> Items)
+      {
+        return ListRef{column<ExprRef>().push(Items), (uint32_t)Items.size()};
+      }
+
+      llvm::ArrayRef<ExprRef> getList(ListRef L) const
+      {
+        return column<ExprRef>().items().slice(L.Begin, L.Size);
+      }
+
+      ListRef addBindings(llvm::ArrayRef<VarBinding> Items)
+      {
+        return ListRef{column<VarBinding>().push(Items), (uint32_t)Items.size()};
+      }
+
+      llvm::ArrayRef<VarBinding> getBindings(ListRef L) const
+      {
+        return column<VarBinding>().items().slice(L.Begin, L.Size);
+      }
+
+      // Calls Fn on every Column, always in the same order. Used to write the
+      // tree out and to point it at mapped memory.
+      template <typename FnT>
+      void forEachColumn(FnT Fn)
+      {
+        forEachColumn(Columns, Fn, std::make_index_sequence<NumColumns>());
+      }
+      template <typename FnT>
+      void forEachColumn(FnT Fn) const
+      {
+        forEachColumn(Columns, Fn, std::make_index_sequence<NumColumns>());
+      }
+
+      // Calls Fn on every non-null direct child of E, in source order.
+      template <typename FnT>
+      void forEachChild(ExprRef E, FnT Fn) const
+      {
+        switch (E.getKind())
+        {
+        case ExprKind::Number:
+        case ExprKind::Variable:
+        case ExprKind::Sync:
+          return;
+        case ExprKind::Binary:
+        {
+          auto &N = get<BinaryExpr>(E);
+          Fn(N.LHS);
+          Fn(N.RHS);
+          return;
+        }
+        case ExprKind::Unary:
+          Fn(get<UnaryExpr>(E).Operand);
+          return;
+        case ExprKind::Call:
+          for (ExprRef Arg : getList(get<CallExpr>(E).Args))
+            Fn(Arg);
+          return;
+        case ExprKind::If:
+        {
+          auto &N = get<IfExpr>(E);
+          Fn(N.Cond);
+          Fn(N.Then);
+          Fn(N.Else);
+          return;
+        }
+        case ExprKind::For:
+        {
+          auto &N = get<ForExpr>(E);
+          Fn(N.Start);
+          Fn(N.End);
+          if (N.Step)
+            Fn(N.Step);
+          Fn(N.Body);
+          return;
+        }
+        case ExprKind::Var:
+        {
+          auto &N = get<VarExpr>(E);
+          for (auto &B : getBindings(N.Bindings))
+          {
+            if (B.Init)
+              Fn(B.Init);
+            if (B.Length)
+              Fn(B.Length);
+          }
+          if (N.Body)
+            Fn(N.Body);
+          return;
+        }
+        case ExprKind::Scope:
+          for (ExprRef Child : getList(get<ScopeExpr>(E).Body))
+            Fn(Child);
+          return;
+        case ExprKind::Index:
+          Fn(get<IndexExpr>(E).Index);
+          return;
+        case ExprKind::Spawn:
+          Fn(get<SpawnExpr>(E).Call);
+          return;
+        }
+      }
+
+      void clear()
+      {
+        forEachColumn([](auto &C)
+                      { C.clear(); });
+      }
+    };
+
+    // Non-virtual visitor over a Tree, in the style of llvm::InstVisitor:
+    // visit() dispatches on the node kind to SubClass::visitNumber(),
+    // visitBinary(), ... Every visitX() defaults to visitExpr(), which visits
+    // the children and returns RetTy(), so a pass only needs to implement the
+    // node kinds it cares about.
+    template <typename SubClass, typename RetTy = void>
+    class ExprVisitor
+    {
+    protected:
+      const Tree &T;
+
+    public:
+      explicit ExprVisitor(const Tree &T) : T(T) {}
+
+      RetTy visit(ExprRef E)
+      {
+        SubClass *Self = static_cast<SubClass *>(this);
+        switch (E.getKind())
+        {
+        case ExprKind::Number:
+          return Self->visitNumber(E, T.get<NumberExpr>(E));
+        case ExprKind::Variable:
+          return Self->visitVariable(E, T.get<VariableExpr>(E));
+        case ExprKind::Binary:
+          return Self->visitBinary(E, T.get<BinaryExpr>(E));
+        case ExprKind::Unary:
+          return Self->visitUnary(E, T.get<UnaryExpr>(E));
+        case ExprKind::Call:
+          return Self->visitCall(E, T.get<CallExpr>(E));
+        case ExprKind::If:
+          return Self->visitIf(E, T.get<IfExpr>(E));
+        case ExprKind::For:
+          return Self->visitFor(E, T.get<ForExpr>(E));
+        case ExprKind::Var:
+          return Self->visitVar(E, T.get<VarExpr>(E));
+        case ExprKind::Scope:
+          return Self->visitScope(E, T.get<ScopeExpr>(E));
+        case ExprKind::Index:
+          return Self->visitIndex(E, T.get<IndexExpr>(E));
+        case ExprKind::Spawn:
+          return Self->visitSpawn(E, T.get<SpawnExpr>(E));
+        case ExprKind::Sync:
+          return Self->visitSync(E, T.get<SyncExpr>(E));
+        }
+        llvm_unreachable("unknown expression kind");
+      }
+
+      RetTy visitExpr(ExprRef E)
+      {
+        T.forEachChild(E, [this](ExprRef Child)
+                       { static_cast<SubClass *>(this)->visit(Child); });
+        return RetTy();
+      }
+
+#define PIZZA_DEFAULT_VISIT(K)                                  \
+  RetTy visit##K(ExprRef E, const K##Expr &)                    \
+  {                                                             \
+    return static_cast<SubClass *>(this)->visitExpr(E);         \
+  }
+      PIZZA_DEFAULT_VISIT(Number)
+      PIZZA_DEFAULT_VISIT(Variable)
+      PIZZA_DEFAULT_VISIT(Binary)
+      PIZZA_DEFAULT_VISIT(Unary)
+      PIZZA_DEFAULT_VISIT(Call)
+      PIZZA_DEFAULT_VISIT(If)
+      PIZZA_DEFAULT_VISIT(For)
+      PIZZA_DEFAULT_VISIT(Var)
+      PIZZA_DEFAULT_VISIT(Scope)
+      PIZZA_DEFAULT_VISIT(Index)
+      PIZZA_DEFAULT_VISIT(Spawn)
+      PIZZA_DEFAULT_VISIT(Sync)
+#undef PIZZA_DEFAULT_VISIT
+    };
+  }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "pizza/symbols.h"
+#include "pizza/tree.h"
+
+namespace Pizza
+{
+  namespace AST
+  {
+    // Finds the loop variables, toppings and expressions of one function body
+    // that only ever hold integers, so codegen can keep them in i64 and
+    // convert to double only where they meet double-typed code.
+    //
+    // The i64 program has to compute what the double one would, so every
+    // integral value must provably stay within +-MaxExact, 2^53 for doubles
+    // and 2^24 for floats: past that the floating-point program rounds where
+    // i64 arithmetic doesn't. Each variable gets a bound on the magnitude of
+    // every value it can hold, from its start value and every value assigned
+    // to it, and an expression is integral only while its bound is within
+    // MaxExact. A loop variable growing by a literal step is bounded by the
+    // end condition "i < X" for an integral X; any other end condition, or
+    // a double X, leaves it double, except in a parallel for, which always
+    // counts in i64 up to a bound clamped to ParallelBound. Variables whose
+    // bound keeps growing, like a topping incremented in a loop, are double
+    // too. Parameters stay double: callers in other modules may pass
+    // anything.
+    class IntegerTypes
+    {
+    private:
+      struct Binding
+      {
+        bool Int;
+        // Largest magnitude of the values the variable holds so far.
+        double Bound;
+        // Whether the body assigns to it, for loop variables.
+        bool Assigned;
+      };
+
+      // Value must be integral for Target to be, and bounds it. For a loop
+      // variable, Loop is its for and Value its step, which must be a literal.
+      struct Constraint
+      {
+        Binding *Target;
+        ExprRef Value;
+        ExprRef Loop;
+      };
+
+      class Collector;
+
+      const Tree *T = nullptr;
+      double MaxExact = 0;
+      std::deque<Binding> Bindings;
+      std::vector<Constraint> Constraints;
+      // Variable and assignment nodes to the binding they refer to.
+      llvm::DenseMap<uint32_t, Binding *> Refs;
+      llvm::DenseMap<uint64_t, Binding *> Sites;
+      // Integral expressions to their bound.
+      llvm::DenseMap<uint32_t, double> IntExprs;
+
+      static uint64_t siteKey(ExprRef Site, unsigned Index)
+      {
+        return (uint64_t)Site.getRaw() << 32 | Index;
+      }
+
+      double literalBound(ExprRef E) const;
+      double refBound(ExprRef E) const;
+      double bound(ExprRef E, bool Final) const;
+      double loopBound(const Constraint &C) const;
+      void record(ExprRef E);
+
+    public:
+      // Array lengths are at most this, which pizza_arena_alloc enforces.
+      static const int64_t MaxArrayLength = int64_t(1) << 48;
+      // A parallel for with a double bound stops below this.
+      static const int64_t ParallelBound = int64_t(1) << 53;
+
+      // MaxExact is the largest integer up to which the program's number
+      // type holds every integer.
+      void run(const Tree &Nodes, llvm::ArrayRef<Symbol> Params, ExprRef Body, double MaxExact);
+
+      // Whether E is computed as an i64.
+      bool isInt(ExprRef E) const { return IntExprs.count(E.getRaw()); }
+      // Whether the variable bound by a for (Index 0) or by the Index'th
+      // binding of a topping declaration is kept in an i64.
+      bool isIntBinding(ExprRef Site, unsigned Index = 0) const
+      {
+        Binding *B = Sites.lookup(siteKey(Site, Index));
+        return B && B->Int;
+      }
+    };
+  }
+}
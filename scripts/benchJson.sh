@@ -0,0 +1,21 @@
+# Generates a program with large expression trees and reports how fast the
+# AST is written as JSON in MB/s.
+# usage: scripts/benchJson.sh [bases] [depth]
+BASES=${1:-2000}
+DEPTH=${2:-200}
+SRC_FILE=build/out/bench_json.pizza
+JSON_FILE=build/out/bench_json.json
+
+awk -v n="$BASES" -v d="$DEPTH" 'BEGIN {
+  print "sauce print(x);"
+  for (i = 0; i < n; i++) {
+    printf "base f%d(a b) {\n", i
+    for (j = 0; j < d; j++)
+      printf "  topping v%d = if a < %d then print(a * %d.5 + b) else (b - a) / 2;\n  {\n", j, j, j
+    for (j = 0; j < d; j++)
+      printf "  };\n"
+    printf "  a;\n};\n"
+  }
+}' > $SRC_FILE
+
+./build/bin/bake --bench-json $SRC_FILE $JSON_FILE
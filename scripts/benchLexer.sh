@@ -0,0 +1,15 @@
+# Generates a large pizza program and reports lexer throughput in MB/s.
+# usage: scripts/benchLexer.sh [bases]
+BASES=${1:-200000}
+SRC_FILE=build/out/bench_lexer.pizza
+
+awk -v n="$BASES" 'BEGIN {
+  print "sauce print(x);"
+  for (i = 0; i < n; i++) {
+    printf "# base %d\n", i
+    printf "base f%d(a b)\n  if a < b then\n    a * %d.25 + b\n  else\n    f%d(a - 1, b);\n", i, i, i
+    printf "topping x = %d, y = 0.5 in print(f%d(x, y));\n", i, i
+  }
+}' > $SRC_FILE
+
+./build/bin/bake --bench-lexer $SRC_FILE
@@ -0,0 +1,30 @@
+# Times a recursive fib that spawns one of its two calls, once with every
+# call made in place (--spawn-depth=0) and once spread over the cores, and
+# reports the speedup.
+# usage: scripts/benchSpawn.sh [n]
+N=${1:-34}
+SRC_FILE=build/out/bench_spawn.pizza
+
+cat > $SRC_FILE <<EOF
+sauce print(x);
+base fib(n)
+  if n < 2 then n else
+    topping a = spawn fib(n - 1), b = fib(n - 2) in
+    {
+      sync;
+      a + b;
+    };
+print(fib($N));
+EOF
+
+# Prints how long bake takes on the program, in milliseconds.
+run() {
+  local start=$(date +%s%N)
+  ./build/bin/bake "$@" $SRC_FILE > /dev/null
+  echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+SERIAL=$(run --spawn-depth=0)
+SPAWNED=$(run)
+echo "fib($N): $SERIAL ms in place, $SPAWNED ms spawned over $(nproc) cores"
+awk -v s="$SERIAL" -v p="$SPAWNED" 'BEGIN { printf "speedup: %.2fx\n", s / (p > 0 ? p : 1) }'
@@ -0,0 +1,30 @@
+# Times a program of top-level expressions that only compute, which bake
+# evaluates at compile time, against the same expressions printed, which
+# each take a trip through the JIT, and reports the speedup.
+# usage: scripts/benchTopLevel.sh [expressions]
+EXPRS=${1:-500}
+PURE_FILE=build/out/bench_toplevel_pure.pizza
+JIT_FILE=build/out/bench_toplevel_jit.pizza
+
+gen() {
+  awk -v n="$EXPRS" -v wrap="$1" 'BEGIN {
+    print "sauce print(x);"
+    print "base fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);"
+    for (i = 0; i < n; i++)
+      printf "%s(fib(%d) + %d * 2);\n", wrap, i % 12, i
+  }'
+}
+gen "" > $PURE_FILE
+gen "print" > $JIT_FILE
+
+# Prints how long bake takes on a program, in milliseconds.
+run() {
+  local start=$(date +%s%N)
+  ./build/bin/bake "$1" > /dev/null
+  echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+JIT=$(run $JIT_FILE)
+PURE=$(run $PURE_FILE)
+echo "$EXPRS expressions: $JIT ms through the JIT, $PURE ms evaluated at compile time"
+awk -v j="$JIT" -v p="$PURE" 'BEGIN { printf "speedup: %.2fx\n", j / (p > 0 ? p : 1) }'
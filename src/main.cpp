@@ -1,36 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <vector>
 
 #include "pizza/ast.h"
 
+static int usage()
+{
+  fprintf(stderr, "Invalid arguments\nusage: bake [-O0|-O1|-O2|-O3|-Os|--fast-compile] [--whole-program] [--memoize[=base,...]] [--stats] [--batch] [--time-compile] [--march=cpu] [--mattr=features] [--target-clones=feature,...] [--precision=f32|f64] [--spawn-depth=N] [--bench-lexer|--bench-json] [--parallel-parse|--ast-cache dir] --repl|srcPath [jsonPath] [llPath]\n");
+  return 1;
+}
+
+// Appends the comma-separated items of arg, from start on, to list.
+static void splitList(const std::string &arg, size_t start, std::vector<std::string> &list)
+{
+  while (start <= arg.size())
+  {
+    size_t end = arg.find(',', start);
+    if (end == std::string::npos)
+      end = arg.size();
+    if (end > start)
+      list.push_back(arg.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
 int main(int argc, const char *argv[])
 {
-  if (argc < 2 || argc > 4)
+  struct Pizza::AST::Options opt = {};
+  opt.spawnDepth = -1;
+  std::vector<std::string> positional;
+
+  for (int i = 1; i < argc; i++)
   {
-    fprintf(stderr, "Invalid arguments\nusage: bake --repl|srcPath [jsonPath] [llPath]\n");
-    return 1;
+    std::string arg = argv[i];
+    if (arg == "--repl")
+      opt.repl = true;
+    else if (arg == "--bench-lexer")
+      opt.benchLexer = true;
+    else if (arg == "--bench-json")
+      opt.benchJson = true;
+    else if (arg == "--fast-compile")
+      opt.fastCompile = true;
+    else if (arg == "--whole-program")
+      opt.wholeProgram = true;
+    else if (arg == "--memoize")
+      opt.memoize = true;
+    else if (arg.compare(0, 10, "--memoize=") == 0)
+    {
+      opt.memoize = true;
+      splitList(arg, 10, opt.memoizeBases);
+    }
+    else if (arg == "--stats")
+      opt.stats = true;
+    else if (arg == "--batch")
+      opt.batch = true;
+    else if (arg.compare(0, 8, "--march=") == 0)
+      opt.march = arg.substr(8);
+    else if (arg.compare(0, 8, "--mattr=") == 0)
+      opt.mattr = arg.substr(8);
+    else if (arg.compare(0, 16, "--target-clones=") == 0)
+      splitList(arg, 16, opt.targetClones);
+    else if (arg == "--time-compile")
+      opt.timeCompile = true;
+    else if (arg == "--precision=f32")
+      opt.singlePrecision = true;
+    else if (arg == "--precision=f64")
+      opt.singlePrecision = false;
+    else if (arg.compare(0, 14, "--spawn-depth=") == 0)
+    {
+      char *end;
+      long depth = strtol(arg.c_str() + 14, &end, 10);
+      if (arg.size() == 14 || *end || depth < 0 || depth > 64)
+        return usage();
+      opt.spawnDepth = (int)depth;
+    }
+    else if (arg == "--parallel-parse")
+      opt.parallelParse = true;
+    else if (arg == "--ast-cache" && i + 1 < argc)
+      opt.astCacheDir = argv[++i];
+    else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 && strchr("0123s", arg[2]))
+      opt.optLevel = arg[2];
+    else if (arg.size() > 1 && arg[0] == '-')
+      return usage();
+    else
+      positional.push_back(arg);
   }
 
-  std::string srcPath = argv[1];
-  bool repl = srcPath == "--repl";
-  std::string jsonPath;
-  std::string llPath;
+  // --repl takes the place of srcPath.
+  size_t first = opt.repl ? 0 : 1;
+  if (positional.size() < first || positional.size() > first + 2)
+    return usage();
+  if (opt.repl && (opt.benchLexer || opt.benchJson || opt.parallelParse || !opt.astCacheDir.empty()))
+    return usage();
+  if (opt.parallelParse && !opt.astCacheDir.empty())
+    return usage();
+  if (opt.fastCompile && (opt.optLevel || opt.wholeProgram))
+    return usage();
+  if (opt.repl && opt.wholeProgram)
+    return usage();
 
-  if (repl)
+  if (!opt.repl)
   {
-    srcPath = "";
+    opt.srcPath = positional[0];
   }
 
-  if (argc >= 3)
+  if (positional.size() >= first + 1)
   {
-    jsonPath = argv[2];
+    opt.jsonPath = positional[first];
   }
 
-  if (argc >= 4)
+  if (positional.size() >= first + 2)
   {
-    llPath = argv[3];
+    opt.llPath = positional[first + 1];
   }
 
-  struct Pizza::AST::Options opt = {repl, srcPath, jsonPath, llPath};
+  // The clones only exist in the llPath output.
+  if (!opt.targetClones.empty() && opt.llPath.empty())
+    return usage();
 
   return Pizza::AST::Run(opt);
 }
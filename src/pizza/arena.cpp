@@ -0,0 +1,53 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "pizza/arena.h"
+
+namespace Pizza
+{
+  // std::max takes its arguments by reference, which needs a definition.
+  const size_t Arena::MinChunkSize;
+
+  void *Arena::take(size_t Chunk, size_t Offset, size_t Bytes)
+  {
+    Live.push_back(Top);
+    Top = {Chunk, Offset + Bytes};
+    char *Ptr = Chunks[Chunk].Begin + Offset;
+    memset(Ptr, 0, Bytes);
+    return Ptr;
+  }
+
+  void *Arena::allocate(size_t Bytes)
+  {
+    // Chunks past the top are free; one too small for Bytes is skipped
+    // until the allocations before it are released.
+    for (size_t I = Top.Chunk; I < Chunks.size(); I++)
+    {
+      size_t Offset = I == Top.Chunk ? (Top.Offset + Alignment - 1) & ~(Alignment - 1) : 0;
+      if (Offset <= Chunks[I].Size && Bytes <= Chunks[I].Size - Offset)
+        return take(I, Offset, Bytes);
+    }
+
+    // Each chunk is at least twice the last, so a program needs few.
+    size_t Size = std::max(MinChunkSize, Chunks.empty() ? 0 : 2 * Chunks.back().Size);
+    Size = std::max(Size, Bytes);
+    if (Size > SIZE_MAX - Alignment)
+      return nullptr;
+    std::unique_ptr<char[]> Storage(new (std::nothrow) char[Size + Alignment - 1]);
+    if (!Storage)
+      return nullptr;
+    uintptr_t Begin = ((uintptr_t)Storage.get() + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+    Chunks.push_back({std::move(Storage), (char *)Begin, Size});
+    return take(Chunks.size() - 1, 0, Bytes);
+  }
+
+  void Arena::release(size_t Mark)
+  {
+    if (Mark >= Live.size())
+      return;
+    Top = Live[Mark];
+    Live.resize(Mark);
+  }
+}
@@ -1,311 +1,254 @@
+#include <chrono>
+#include <cmath>
+#include <deque>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <memory>
 #include <map>
 #include <stdio.h>
-#include <fstream>
-#include <stack>
+#include <stdlib.h>
+#include <string.h>
+#include <bitset>
+#include <future>
 
 #include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/Optional.h>
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SetVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalIFunc.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/X86TargetParser.h>
+#include <llvm/Support/xxhash.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Transforms/InstCombine/InstCombine.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Scalar/GVN.h>
 #include <llvm/Transforms/Utils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
+#include "pizza/arena.h"
 #include "pizza/ast.h"
+#include "pizza/cache.h"
 #include "pizza/jit.h"
+#include "pizza/lexer.h"
+#include "pizza/memo.h"
+#include "pizza/pool.h"
+#include "pizza/source.h"
+#include "pizza/symbols.h"
+#include "pizza/tasks.h"
+#include "pizza/tree.h"
+#include "pizza/types.h"
 
 using namespace llvm;
 
-enum Token
-{
-  tok_eof = -1,
-  tok_base = -2,
-  tok_topping = -3,
-  tok_identifier = -4,
-  tok_number = -5,
-  tok_sauce = -6,
-  tok_if = -7,
-  tok_then = -8,
-  tok_else = -9,
-  tok_for = -10,
-  tok_in = -11,
-  tok_binary = -12,
-  tok_unary = -13
-};
+using namespace Pizza;
+using namespace Pizza::AST;
 
 static bool replMode;
-static FILE *srcFile;
-static std::ofstream jsonFile;
+static bool fastCompile;
+static bool timeCompile;
+static bool singlePrecision;
+static bool wholeProgram;
+static bool memoize;
+static bool printStats;
+static bool emitBatch;
+// --spawn-depth, or -1 to pick a depth from the core count.
+static int spawnDepth;
+static std::unique_ptr<Pizza::Source> Src;
+static std::unique_ptr<Pizza::Lexer> Lex;
+static std::unique_ptr<raw_fd_ostream> jsonFile;
 static std::unique_ptr<raw_fd_ostream> llFile;
-static std::string IdentifierStr;
-static double NumVal;
-
-static int getNextChar()
-{
-  if (replMode)
-    return getchar();
-  else
-    return fgetc(srcFile);
-}
-
-static int gettok()
-{
-  static int LastChar = ' ';
-
-  while (isspace(LastChar))
-    LastChar = getNextChar();
-
-  if (isalpha(LastChar))
-  {
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getNextChar())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "base")
-      return tok_base;
-    if (IdentifierStr == "topping")
-      return tok_topping;
-    if (IdentifierStr == "sauce")
-      return tok_sauce;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "binary")
-      return tok_binary;
-    if (IdentifierStr == "unary")
-      return tok_unary;
-    if (IdentifierStr == "topping")
-      return tok_topping;
-    return tok_identifier;
-  }
-
-  if (isdigit(LastChar) || LastChar == '.')
-  { // Number: [0-9.]+
-    std::string NumStr;
-    do
-    {
-      NumStr += LastChar;
-      LastChar = getNextChar();
-    } while (isdigit(LastChar) || LastChar == '.');
-
-    NumVal = strtod(NumStr.c_str(), nullptr);
-    return tok_number;
-  }
-
-  if (LastChar == '#')
-  {
-    do
-      LastChar = getNextChar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
-    if (LastChar != EOF)
-      return gettok();
-  }
-
-  // Check for end of file.  Don't eat the EOF.
-  if (LastChar == EOF)
-    return tok_eof;
-
-  // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = getNextChar();
-  return ThisChar;
-}
+// Every identifier in the program, interned by the lexer.
+static SymbolTable Symbols;
+static const Symbol AnonExprSym = Symbols.intern("__anon_expr");
+static const Symbol LastValueSym = Symbols.intern("_");
 
 namespace
 {
   Value *LogErrorV(const char *Str);
-  static int CurTok;
-  static int getNextToken();
   static std::map<char, int> BinopPrecedence;
   static std::unique_ptr<LLVMContext> TheContext;
   static std::unique_ptr<Module> TheModule;
   static std::unique_ptr<IRBuilder<>> Builder;
   static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-  static std::unique_ptr<Pizza::JIT> TheJIT;
-  static llvm::ExitOnError ExitOnErr;
-
-  Function *getFunction(const std::string &Name);
-
-  class ExprAST
-  {
-  public:
-    virtual ~ExprAST() {}
-    virtual const std::string dump() const = 0;
-    virtual Value *codegen() = 0;
-  };
 
-  class NumberExprAST : public ExprAST
+  // Standard new pass manager pipeline for -O0..-O3/-Os, run over each
+  // module right before it goes to the JIT. Without -O, TheFPM's short
+  // per-function pipeline is used instead.
+  class ModuleOptimizer
   {
-    double Val;
+  private:
+    std::unique_ptr<TargetMachine> TM;
+    TargetLibraryInfoImpl TLII;
+    PassBuilder PB;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    ModulePassManager MPM;
+    bool Inlines;
 
   public:
-    NumberExprAST(double Val) : Val(Val) {}
-
-    Value *codegen() override;
-
-    const std::string dump() const override
+    // VectorMath lets the vectorizer call libmvec's SIMD versions of the
+    // math intrinsics.
+    ModuleOptimizer(std::unique_ptr<TargetMachine> TM, char Level, bool VectorMath)
+        : TM(std::move(TM)), TLII(this->TM->getTargetTriple()),
+          PB(/*DebugLogging=*/false, this->TM.get()), Inlines(Level != '0')
     {
-      return "{\"num\":" + std::to_string(Val) + "}";
+      if (VectorMath)
+        TLII.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86);
+      // Registered first, so it takes the place of the default one.
+      FAM.registerPass([this]
+                       { return TargetLibraryAnalysis(TLII); });
+      PB.registerModuleAnalyses(MAM);
+      PB.registerCGSCCAnalyses(CGAM);
+      PB.registerFunctionAnalyses(FAM);
+      PB.registerLoopAnalyses(LAM);
+      PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+      switch (Level)
+      {
+      case '1':
+        MPM = PB.buildPerModuleDefaultPipeline(PassBuilder::OptimizationLevel::O1);
+        break;
+      case '2':
+        MPM = PB.buildPerModuleDefaultPipeline(PassBuilder::OptimizationLevel::O2);
+        break;
+      case '3':
+        MPM = PB.buildPerModuleDefaultPipeline(PassBuilder::OptimizationLevel::O3);
+        break;
+      case 's':
+        MPM = PB.buildPerModuleDefaultPipeline(PassBuilder::OptimizationLevel::Os);
+        break;
+      default: // -O0 runs no passes.
+        break;
+      }
     }
-  };
-
-  class VariableExprAST : public ExprAST
-  {
-    std::string Name;
-
-  public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
-
-    Value *codegen() override;
 
-    const std::string getName() const
-    {
-      return Name;
-    }
+    // Whether the pipeline runs the inliner, and so can use bodies imported
+    // from other modules.
+    bool inlines() const { return Inlines; }
 
-    const std::string dump() const override
+    void run(Module &M)
     {
-      std::string str = "{\"var\":\"";
-      str += this->Name;
-      str += "\"}";
-
-      return str;
+      MPM.run(M, MAM);
+      // Cached results point into M, which is about to be handed off.
+      LAM.clear();
+      FAM.clear();
+      CGAM.clear();
+      MAM.clear();
     }
   };
 
-  class BinaryExprAST : public ExprAST
-  {
-    char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
-
-  public:
-    BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
-                  std::unique_ptr<ExprAST> RHS)
-        : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-
-    Value *codegen() override;
-
-    const std::string dump() const override
-    {
-      std::string str = "{\"op\":\"";
-      str += this->Op;
-      str += "\",\"lhs\":";
-      str += this->LHS->dump();
-      str += ",\"rhs\":";
-      str += this->RHS->dump();
-      str += "}";
+  static std::unique_ptr<ModuleOptimizer> TheMPM;
+  static std::unique_ptr<Pizza::JIT> TheJIT;
+  static llvm::ExitOnError ExitOnErr;
 
-      return str;
-    }
-  };
+  Function *getFunction(Symbol Name);
+  static bool HasHostABI(Symbol Name);
 
-  class CallExprAST : public ExprAST
+  // Type of every number: double, or float under --precision=f32.
+  static Type *getNumTy()
   {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
-
-  public:
-    CallExprAST(const std::string &Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
-
-    const std::string dump() const override
-    {
-      std::string str = "{\"callee\":\"";
-      str += this->Callee;
-      str += "\",\"args\":[";
-
-      for (const auto &arg : this->Args)
-      {
-        str += arg->dump() + ",";
-      }
-      if (this->Args.size() > 0)
-      {
-        str = str.substr(0, str.size() - 1);
-      }
-      str += "]}";
+    return singlePrecision ? Type::getFloatTy(*TheContext) : Type::getDoubleTy(*TheContext);
+  }
 
-      return str;
-    }
+  // Largest integer up to which the number type holds every integer.
+  static double getMaxExact()
+  {
+    return singlePrecision ? 0x1p24 : 0x1p53;
+  }
 
-    Value *codegen() override;
-  };
+  // Expression nodes of the top-level item being handled. Cleared once the
+  // item is done, which releases the whole tree at once.
+  static Tree ASTTree;
 
   class PrototypeAST
   {
-    std::string Name;
-    std::vector<std::string> Args;
+    Symbol Name;
+    std::vector<Symbol> Args;
     bool IsOperator;
     unsigned Precedence; // Precedence if a binary op.
+    bool HostABI = false;
 
   public:
-    PrototypeAST(const std::string &name, std::vector<std::string> Args, bool IsOperator = false, unsigned Prec = 0)
+    PrototypeAST(Symbol name, std::vector<Symbol> Args, bool IsOperator = false, unsigned Prec = 0)
         : Name(name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec) {}
 
-    const std::string &getName() const { return Name; }
+    Symbol getName() const { return Name; }
+    const std::vector<Symbol> &getArgs() const { return Args; }
 
+    bool isOperator() const { return IsOperator; }
     bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
     bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
 
     char getOperatorName() const
     {
       assert(isUnaryOp() || isBinaryOp());
-      return Name[Name.size() - 1];
+      return Symbols.name(Name).back();
     }
 
     unsigned getBinaryPrecedence() const { return Precedence; }
 
-    const std::string dump()
+    // Whether the function takes and returns doubles whatever the precision
+    // of the program, as C functions and callers from C++ expect.
+    bool usesHostABI() const { return HostABI; }
+    void setHostABI(bool Host) { HostABI = Host; }
+
+    void dump(raw_ostream &OS) const
     {
-      std::string str = "{\"name\":";
-      if (this->Name.size() > 0)
-      {
-        str += "\"" + this->Name + "\"";
-      }
+      OS << "{\"name\":";
+      StringRef Name = Symbols.name(this->Name);
+      if (Name.size() > 0)
+        OS << '"' << Name << '"';
       else
+        OS << "null";
+      OS << ",\"args\":[";
+      for (size_t i = 0; i < this->Args.size(); i++)
       {
-        str += "null";
-      }
-      str += ",\"args\":[";
-
-      for (const auto &arg : this->Args)
-      {
-        str += "\"" + arg + "\",";
+        if (i)
+          OS << ',';
+        OS << '"' << Symbols.name(this->Args[i]) << '"';
       }
-      if (this->Args.size() > 0)
-      {
-        str = str.substr(0, str.size() - 1);
-      }
-      str += "]}";
-
-      return str;
+      OS << "]}";
     }
 
     Function *codegen();
@@ -314,255 +257,665 @@ namespace
   class FunctionAST
   {
     std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
-    std::string Name;
+    ExprRef Body;
+    Symbol Name;
 
   public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                std::unique_ptr<ExprAST> Body)
-        : Proto(std::move(Proto)), Body(std::move(Body))
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprRef Body)
+        : Proto(std::move(Proto)), Body(Body)
     {
       Name = this->Proto->getName();
     }
 
-    const std::string &getName()
+    Symbol getName()
     {
       return Name;
     }
 
-    const std::string dump()
-    {
-      std::string str = "{\"function\":{\"proto\":";
-      str += this->Proto->dump();
-      str += ",\"body\":";
-      str += this->Body->dump();
-      str += "}}";
-      return str;
-    }
+    const PrototypeAST &getProto() const { return *Proto; }
+    ExprRef getBody() const { return Body; }
 
-    Function *codegen();
+    void dump(raw_ostream &OS, const Tree &T) const;
+
+    Function *codegen(const Tree &T);
   };
 
-  class IfExprAST : public ExprAST
+  static const char *getReductionName(Reduction R)
   {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
-
-  public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-              std::unique_ptr<ExprAST> Else)
-        : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
-
-    Value *codegen() override;
-
-    const std::string dump() const override
+    switch (R)
     {
-      std::string str = "{\"if\":{\"cond\":";
-      str += this->Cond->dump();
-      str += ",\"then\":";
-      str += this->Then->dump();
-      str += ",\"else\":";
-      str += this->Else->dump();
-      str += "}}";
-      return str;
+    case Reduction::Sum:
+      return "sum";
+    case Reduction::Product:
+      return "product";
+    case Reduction::Min:
+      return "min";
+    case Reduction::Max:
+      return "max";
+    case Reduction::None:
+      break;
     }
-  };
+    llvm_unreachable("not a reduction");
+  }
 
-  class ForExprAST : public ExprAST
+  // Writes the JSON form of an expression straight into a stream, in one
+  // pass over the tree.
+  class JSONWriter : public ExprVisitor<JSONWriter>
   {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
+    raw_ostream &OS;
 
-  public:
-    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-               std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-               std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-          Step(std::move(Step)), Body(std::move(Body)) {}
+    void writeName(Symbol S)
+    {
+      OS << '"' << Symbols.name(S) << '"';
+    }
 
-    const std::string dump() const override
+    void writeList(ArrayRef<ExprRef> Exprs)
     {
-      std::string str = "{\"for\":{\"var\":\"";
-      str += this->VarName;
-      str += "\",\"start\":";
-      str += this->Start->dump();
-      str += ",\"end:\":";
-      str += this->End->dump();
-      if (this->Step)
+      for (size_t i = 0; i < Exprs.size(); i++)
       {
-        str += ",\"step:\":";
-        str += this->Step->dump();
+        if (i)
+          OS << ',';
+        visit(Exprs[i]);
       }
-      str += ",\"body:\":";
-      str += this->Body->dump();
-      str += "}}";
-      return str;
     }
 
-    Value *codegen() override;
-  };
-
-  class UnaryExprAST : public ExprAST
-  {
-    char Opcode;
-    std::unique_ptr<ExprAST> Operand;
-
   public:
-    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-        : Opcode(Opcode), Operand(std::move(Operand)) {}
+    JSONWriter(raw_ostream &OS, const Tree &T) : ExprVisitor(T), OS(OS) {}
 
-    const std::string dump() const override
+    void visitNumber(ExprRef, const NumberExpr &N)
     {
-      std::string str = "{\"unary\":{\"opcode\":\"";
-      str += Opcode;
-      str += "\",\"operand\":";
-      str += Operand->dump();
-      str += "}}";
-      return str;
+      OS << "{\"num\":" << format("%f", N.Val) << '}';
     }
 
-    Value *codegen() override;
-  };
+    void visitVariable(ExprRef, const VariableExpr &N)
+    {
+      OS << "{\"var\":";
+      writeName(N.Name);
+      OS << '}';
+    }
 
-  class VarExprAST : public ExprAST
-  {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-    std::unique_ptr<ExprAST> Body;
+    void visitBinary(ExprRef, const BinaryExpr &N)
+    {
+      OS << "{\"op\":\"" << N.Op << "\",\"lhs\":";
+      visit(N.LHS);
+      OS << ",\"rhs\":";
+      visit(N.RHS);
+      OS << '}';
+    }
 
-  public:
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-               std::unique_ptr<ExprAST> Body)
-        : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+    void visitCall(ExprRef, const CallExpr &N)
+    {
+      OS << "{\"callee\":";
+      writeName(N.Callee);
+      OS << ",\"args\":[";
+      writeList(T.getList(N.Args));
+      OS << "]}";
+    }
 
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames)
-        : VarNames(std::move(VarNames)) {}
+    void visitIf(ExprRef, const IfExpr &N)
+    {
+      OS << "{\"if\":{\"cond\":";
+      visit(N.Cond);
+      OS << ",\"then\":";
+      visit(N.Then);
+      OS << ",\"else\":";
+      visit(N.Else);
+      OS << "}}";
+    }
 
-    const std::string dump() const override
+    void visitFor(ExprRef, const ForExpr &N)
     {
-      std::string str = "{\"var\":{\"names\":[";
-      for (const auto &VarName : this->VarNames)
+      OS << "{\"for\":{\"var\":";
+      writeName(N.VarName);
+      OS << ",\"start\":";
+      visit(N.Start);
+      OS << ",\"end:\":";
+      visit(N.End);
+      if (N.Step)
       {
-        str += "{\"name\":\"" + VarName.first + "\"";
-        if (VarName.second)
-          str += ",\"value\":" + VarName.second->dump();
-        str += "},";
+        OS << ",\"step:\":";
+        visit(N.Step);
       }
-      if (this->VarNames.size() > 0)
+      if (N.Parallel)
+        OS << ",\"parallel\":true";
+      if (N.Reduce != Reduction::None)
+        OS << ",\"reduce\":\"" << getReductionName(N.Reduce) << '"';
+      OS << ",\"body:\":";
+      visit(N.Body);
+      OS << "}}";
+    }
+
+    void visitUnary(ExprRef, const UnaryExpr &N)
+    {
+      OS << "{\"unary\":{\"opcode\":\"" << N.Opcode << "\",\"operand\":";
+      visit(N.Operand);
+      OS << "}}";
+    }
+
+    void visitVar(ExprRef, const VarExpr &N)
+    {
+      OS << "{\"var\":{\"names\":[";
+      auto VarNames = T.getBindings(N.Bindings);
+      for (size_t i = 0; i < VarNames.size(); i++)
       {
-        str = str.substr(0, str.size() - 1);
+        if (i)
+          OS << ',';
+        OS << "{\"name\":";
+        writeName(VarNames[i].Name);
+        if (VarNames[i].Init)
+        {
+          OS << ",\"value\":";
+          visit(VarNames[i].Init);
+        }
+        if (VarNames[i].Length)
+        {
+          OS << ",\"length\":";
+          visit(VarNames[i].Length);
+        }
+        OS << '}';
       }
-      str += "]";
-      if (Body)
+      OS << ']';
+      if (N.Body)
       {
-        str += ",\"body\":";
-        str += Body->dump();
+        OS << ",\"body\":";
+        visit(N.Body);
       }
-      str += "}}";
-      return str;
+      OS << "}}";
+    }
+
+    void visitScope(ExprRef, const ScopeExpr &N)
+    {
+      OS << "{\"scope\":[";
+      writeList(T.getList(N.Body));
+      OS << "]}";
+    }
+
+    void visitIndex(ExprRef, const IndexExpr &N)
+    {
+      OS << "{\"index\":{\"array\":";
+      writeName(N.Array);
+      OS << ",\"at\":";
+      visit(N.Index);
+      OS << "}}";
+    }
+
+    void visitSpawn(ExprRef, const SpawnExpr &N)
+    {
+      OS << "{\"spawn\":";
+      visit(N.Call);
+      OS << '}';
+    }
+
+    void visitSync(ExprRef, const SyncExpr &)
+    {
+      OS << "{\"sync\":{}}";
     }
+  };
+
+  void FunctionAST::dump(raw_ostream &OS, const Tree &T) const
+  {
+    OS << "{\"function\":{\"proto\":";
+    Proto->dump(OS);
+    OS << ",\"body\":";
+    JSONWriter(OS, T).visit(Body);
+    OS << "}}";
+  }
 
-    Value *codegen() override;
+  // Self calls in tail position of one base, which codegen compiles into a
+  // jump back to the top of the body instead of a call. A self call that is
+  // an operand of a '+' or '*' in tail position qualifies too: the other
+  // operand is folded into an accumulator that is applied to the value the
+  // base finally returns, so n + f(n - 1) runs in constant stack. That
+  // reassociates the sum or product, which only changes the result when the
+  // partial values are not exactly representable.
+  struct TailRecursion
+  {
+    DenseSet<uint32_t> Calls;
+    // Accumulating '+' and '*' nodes, to whether the call is their LHS.
+    DenseMap<uint32_t, bool> Accumulated;
+    char AccOp = 0;
+
+    BasicBlock *Header = nullptr;
+    std::vector<AllocaInst *> Params;
+    AllocaInst *Acc = nullptr;
+    // Where the arena was when the body started, if it declares arrays. A
+    // jump leaves every scope of the body at once, so it releases them all.
+    Value *ArenaMark = nullptr;
+
+    bool empty() const { return Calls.empty() && Accumulated.empty(); }
   };
 
-  class ScopeExprAST : public ExprAST
+  // Emits the IR for one function body. Values IntegerTypes proved integral
+  // are i64; everything else, and every value crossing a call or return, is
+  // a double.
+  class CodeGen : public ExprVisitor<CodeGen, Value *>
   {
-    std::vector<std::unique_ptr<ExprAST>> Body;
+  private:
+    const IntegerTypes &Types;
+    const TailRecursion &Tail;
+    // The frame's Pizza::TaskGroup, if the body spawns.
+    AllocaInst *Group;
+    // Array accesses whose bounds check the enclosing loop already did.
+    DenseSet<uint32_t> Unchecked;
+
+    bool visitArgs(const CallExpr &N, std::vector<Value *> &ArgsV);
+    Value *emitTailJump(ArrayRef<Value *> ArgsV);
+    Value *emitAccumulate(const BinaryExpr &N, bool CallOnLHS);
+    Value *emitElementPtr(ExprRef E, const IndexExpr &N);
+    Value *emitIntBound(ExprRef E, const ForExpr &N);
+    Value *emitHoistedChecks(const ForExpr &N, Value *Start, Value *Bound,
+                             DenseSet<uint32_t> &Hoisted);
+    bool emitLoop(ExprRef E, const ForExpr &N, Value *Bound, Value *ArenaMark,
+                  BasicBlock *&AfterBB);
+    bool emitLoops(ExprRef E, const ForExpr &N, Value *Start, Value *Bound,
+                   Value *ArenaMark, BasicBlock *&AfterBB);
+    Value *emitParallelFor(ExprRef E, const ForExpr &N, Value *StartVal);
+    bool emitParallelBody(ExprRef E, const ForExpr &N, Function *Body, StructType *CapturesTy,
+                          ArrayRef<std::pair<Symbol, AllocaInst *>> Captures);
+    bool emitSpawn(const SpawnExpr &N, function_ref<Value *()> Dest);
+    void releaseArena(Value *ArenaMark);
 
   public:
-    ScopeExprAST(std::vector<std::unique_ptr<ExprAST>> Body)
-        : Body(std::move(Body)) {}
+    CodeGen(const Tree &T, const IntegerTypes &Types, const TailRecursion &Tail, AllocaInst *Group)
+        : ExprVisitor(T), Types(Types), Tail(Tail), Group(Group) {}
+
+    Value *visitNumber(ExprRef, const NumberExpr &N);
+    Value *visitVariable(ExprRef, const VariableExpr &N);
+    Value *visitBinary(ExprRef, const BinaryExpr &N);
+    Value *visitUnary(ExprRef, const UnaryExpr &N);
+    Value *visitCall(ExprRef, const CallExpr &N);
+    Value *visitIf(ExprRef, const IfExpr &N);
+    Value *visitFor(ExprRef, const ForExpr &N);
+    Value *visitVar(ExprRef, const VarExpr &N);
+    Value *visitScope(ExprRef, const ScopeExpr &N);
+    Value *visitIndex(ExprRef, const IndexExpr &N);
+    Value *visitSpawn(ExprRef, const SpawnExpr &N);
+    Value *visitSync(ExprRef, const SyncExpr &N);
+  };
 
-    const std::string dump() const override
+  // Variables visible to codegen.
+  static ScopedSymbolTable<AllocaInst *> NamedValues;
+  static DenseMap<Symbol, std::unique_ptr<PrototypeAST>> FunctionProtos;
+  // Functions declared or defined in TheModule, so lookups don't go through
+  // the module's string-keyed symbol table.
+  static DenseMap<Symbol, Function *> ModuleFunctions;
+  // Functions the definition being generated outlined the bodies of its
+  // parallel fors and its spawned calls into, which live and die with it.
+  static SmallVector<Function *, 4> ParallelBodies;
+  // The most chunks pizza_parallel_for splits a loop into, each with a
+  // result of its own. The count doesn't depend on the machine, so neither
+  // does how a reduction over the chunks rounds.
+  static const unsigned MaxParallelChunks = 256;
+  // Names of the "binary<op>" and "unary<op>" functions that implement
+  // user-defined operators, interned once before parsing starts.
+  static Symbol OperatorSymbols[2][128];
+
+  void InternOperatorSymbols()
+  {
+    for (int Op = 0; Op < 128; Op++)
     {
-      std::string str = "{\"scope\":[";
-      for (const auto &e : Body)
-      {
-        str += e->dump();
-        str += ",";
-      }
-      if (Body.size() > 0)
-      {
-        str = str.substr(0, str.size() - 1);
-      }
-      str += "]}";
-      return str;
+      OperatorSymbols[0][Op] = Symbols.intern("unary" + std::string(1, (char)Op));
+      OperatorSymbols[1][Op] = Symbols.intern("binary" + std::string(1, (char)Op));
     }
+  }
+
+  Symbol getOperatorSymbol(bool Binary, int Op)
+  {
+    assert(isascii(Op) && "operators are ASCII characters");
+    return OperatorSymbols[Binary][Op];
+  }
+
+  // Names defined by a base, which then no longer refer to a C function.
+  static DenseSet<Symbol> DefinedBases;
 
-    Value *codegen() override;
+  struct MathSauce
+  {
+    Intrinsic::ID ID;
+    unsigned NumArgs;
   };
+  // libm functions with an LLVM intrinsic. Unlike an opaque call to a
+  // sauce, the optimizer can fold, hoist and vectorize those.
+  static DenseMap<Symbol, MathSauce> MathSauces;
+
+  static void InternMathSauces()
+  {
+    static const struct
+    {
+      const char *Name;
+      Intrinsic::ID ID;
+      unsigned NumArgs;
+    } Table[] = {
+        {"sqrt", Intrinsic::sqrt, 1},
+        {"sin", Intrinsic::sin, 1},
+        {"cos", Intrinsic::cos, 1},
+        {"exp", Intrinsic::exp, 1},
+        {"exp2", Intrinsic::exp2, 1},
+        {"log", Intrinsic::log, 1},
+        {"log2", Intrinsic::log2, 1},
+        {"log10", Intrinsic::log10, 1},
+        {"fabs", Intrinsic::fabs, 1},
+        {"floor", Intrinsic::floor, 1},
+        {"ceil", Intrinsic::ceil, 1},
+        {"trunc", Intrinsic::trunc, 1},
+        {"round", Intrinsic::round, 1},
+        {"rint", Intrinsic::rint, 1},
+        {"nearbyint", Intrinsic::nearbyint, 1},
+        {"pow", Intrinsic::pow, 2},
+        {"fmin", Intrinsic::minnum, 2},
+        {"fmax", Intrinsic::maxnum, 2},
+        {"copysign", Intrinsic::copysign, 2},
+        {"fma", Intrinsic::fma, 3},
+    };
+    for (const auto &Entry : Table)
+      MathSauces[Symbols.intern(Entry.Name)] = {Entry.ID, Entry.NumArgs};
+  }
 
-  static std::stack<std::map<std::string, AllocaInst *>> NamedValuesFrame;
-  static std::map<std::string, AllocaInst *> NamedValues;
-  static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-  std::unique_ptr<ExprAST> LogError(const char *Str);
-  static std::unique_ptr<ExprAST> ParseExpression();
-  static std::unique_ptr<ExprAST> ParseUnary();
-  std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
-  static std::unique_ptr<ExprAST> ParsePrimary();
-  static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                                std::unique_ptr<ExprAST> LHS);
-  static std::unique_ptr<ExprAST> ParseParenExpr();
-  static std::unique_ptr<ExprAST> ParseScopeExpr();
-  static std::unique_ptr<ExprAST> ParseNumberExpr();
+  // The intrinsic a call to Name with NumArgs arguments is lowered to, or
+  // not_intrinsic. Only a sauce stands for the libm function: a base of the
+  // same name is whatever it was defined as.
+  static Intrinsic::ID GetMathIntrinsic(Symbol Name, size_t NumArgs)
+  {
+    auto MI = MathSauces.find(Name);
+    if (MI == MathSauces.end() || MI->second.NumArgs != NumArgs ||
+        !HasHostABI(Name) || DefinedBases.count(Name))
+      return Intrinsic::not_intrinsic;
+    return MI->second.ID;
+  }
+  ExprRef LogError(const char *Str);
   void InitializeModuleAndPassManager(void);
 
-  void StoreNamedValues(bool copy = true)
+  static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+                                            Symbol VarName, bool IsInt = false)
   {
-    NamedValuesFrame.push(std::move(NamedValues));
-    if (copy)
-      NamedValues = std::move(std::map<std::string, AllocaInst *>(NamedValuesFrame.top()));
-    else
-      NamedValues = std::move(std::map<std::string, AllocaInst *>());
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                     TheFunction->getEntryBlock().begin());
+    Type *Ty = IsInt ? Type::getInt64Ty(*TheContext) : getNumTy();
+    return TmpB.CreateAlloca(Ty, 0, Symbols.name(VarName));
+  }
+
+  static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, Type *Ty,
+                                            const Twine &Name)
+  {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                     TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, 0, Name);
   }
 
-  void RestoreNamedValues()
+  // Converts a value to Ty: an i64 to the number it stands for, or a number
+  // to another precision at the boundary with the double ABI.
+  static Value *convertTo(Value *V, Type *Ty)
   {
-    NamedValues = std::move(std::map<std::string, AllocaInst *>(NamedValuesFrame.top()));
-    NamedValuesFrame.pop();
+    if (V->getType() == Ty)
+      return V;
+    if (V->getType()->isIntegerTy())
+      return Builder->CreateSIToFP(V, Ty, "itofp");
+    return Builder->CreateFPCast(V, Ty, "fpcast");
   }
 
-  static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                            const std::string &VarName)
+  static Value *toNum(Value *V) { return convertTo(V, getNumTy()); }
+
+  // Calls F, converting the arguments to its parameter types and the result
+  // back to the program's number type.
+  static Value *CreateNumCall(Function *F, ArrayRef<Value *> Args, const Twine &Name)
+  {
+    SmallVector<Value *, 4> ArgsV;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+      ArgsV.push_back(convertTo(Args[i], F->getFunctionType()->getParamType(i)));
+    return toNum(Builder->CreateCall(F, ArgsV, Name));
+  }
+
+  // Compares a condition of either type against zero.
+  static Value *isTrue(Value *V, const Twine &Name)
+  {
+    if (V->getType()->isIntegerTy())
+      return Builder->CreateICmpNE(V, ConstantInt::get(V->getType(), 0), Name);
+    return Builder->CreateFCmpONE(V, ConstantFP::get(V->getType(), 0.0), Name);
+  }
+
+  // What an array topping's alloca holds: its elements, in the arena, and
+  // its length.
+  static StructType *getArrayTy()
+  {
+    return StructType::get(getNumTy()->getPointerTo(), Type::getInt64Ty(*TheContext));
+  }
+
+  static bool isArray(AllocaInst *A) { return A->getAllocatedType()->isStructTy(); }
+
+  // Until its declaration runs, an array has length 0, so every access to
+  // it is out of bounds.
+  static AllocaInst *CreateArrayAlloca(Function *TheFunction, Symbol VarName)
+  {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                     TheFunction->getEntryBlock().begin());
+    AllocaInst *Alloca = TmpB.CreateAlloca(getArrayTy(), 0, Symbols.name(VarName));
+    TmpB.CreateStore(Constant::getNullValue(getArrayTy()), Alloca);
+    return Alloca;
+  }
+
+  // Converts an array length or index to an i64, truncating toward zero.
+  // Numbers that don't convert, NaN or out of range, become -1, which every
+  // length and bounds check rejects.
+  static Value *toCount(Value *V, const Twine &Name)
+  {
+    if (V->getType()->isIntegerTy())
+      return V;
+    Constant *Invalid = ConstantFP::get(V->getType(), -1.0);
+    Value *Valid = Builder->CreateAnd(Builder->CreateFCmpOGT(V, Invalid),
+                                      Builder->CreateFCmpOLT(V, ConstantFP::get(V->getType(), 0x1p62)));
+    V = Builder->CreateSelect(Valid, V, Invalid);
+    return Builder->CreateFPToSI(V, Type::getInt64Ty(*TheContext), Name);
+  }
+
+  // Array storage comes from the runtime's Pizza::Arena. Each scope that
+  // declares arrays takes a mark on the way in and releases it on the way
+  // out. The arena never hands out the same memory to two live arrays,
+  // which the noalias result tells the optimizer.
+  static Value *EmitArenaAlloc(Value *Count)
+  {
+    LLVMContext &C = *TheContext;
+    AttributeList Attrs = AttributeList::get(
+        C, {{AttributeList::ReturnIndex, Attribute::get(C, Attribute::NoAlias)},
+            {AttributeList::ReturnIndex, Attribute::getWithAlignment(C, Align(Pizza::Arena::Alignment))}});
+    FunctionCallee Alloc = TheModule->getOrInsertFunction(
+        "pizza_arena_alloc", Attrs, Type::getInt8PtrTy(C), Type::getInt64Ty(C), Type::getInt64Ty(C));
+    Value *Size = ConstantInt::get(Type::getInt64Ty(C), TheModule->getDataLayout().getTypeAllocSize(getNumTy()));
+    Value *Ptr = Builder->CreateCall(Alloc, {Count, Size}, "array");
+    return Builder->CreateBitCast(Ptr, getNumTy()->getPointerTo());
+  }
+
+  static Value *EmitArenaMark()
+  {
+    FunctionCallee Mark = TheModule->getOrInsertFunction("pizza_arena_mark", Type::getInt64Ty(*TheContext));
+    return Builder->CreateCall(Mark, {}, "arena.mark");
+  }
+
+  static void EmitArenaRelease(Value *Mark)
+  {
+    FunctionCallee Release = TheModule->getOrInsertFunction(
+        "pizza_arena_release", Type::getVoidTy(*TheContext), Type::getInt64Ty(*TheContext));
+    Builder->CreateCall(Release, {Mark});
+  }
+
+  // Stops the program unless 0 <= Index < Length.
+  static void EmitBoundsCheck(Value *Index, Value *Length)
+  {
+    LLVMContext &C = *TheContext;
+    AttributeList Attrs = AttributeList::get(
+        C, {{AttributeList::FunctionIndex, Attribute::get(C, Attribute::NoReturn)},
+            {AttributeList::FunctionIndex, Attribute::get(C, Attribute::Cold)}});
+    FunctionCallee Error = TheModule->getOrInsertFunction(
+        "pizza_bounds_error", Attrs, Type::getVoidTy(C), Type::getInt64Ty(C), Type::getInt64Ty(C));
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *FailBB = BasicBlock::Create(C, "outofbounds", TheFunction);
+    BasicBlock *OkBB = BasicBlock::Create(C, "inbounds", TheFunction);
+    // Unsigned, so a negative index fails too.
+    Builder->CreateCondBr(Builder->CreateICmpULT(Index, Length, "inbounds"), OkBB, FailBB);
+    Builder->SetInsertPoint(FailBB);
+    Builder->CreateCall(Error, {Index, Length});
+    Builder->CreateUnreachable();
+    Builder->SetInsertPoint(OkBB);
+  }
+
+  class ArrayFinder : public ExprVisitor<ArrayFinder>
+  {
+  public:
+    bool Found = false;
+
+    using ExprVisitor::ExprVisitor;
+
+    void visitVar(ExprRef E, const VarExpr &N)
+    {
+      for (const auto &VB : T.getBindings(N.Bindings))
+        if (VB.Length)
+          Found = true;
+      visitExpr(E);
+    }
+  };
+
+  static bool DeclaresArrays(const Tree &T, ExprRef E)
+  {
+    ArrayFinder Arrays(T);
+    Arrays.visit(E);
+    return Arrays.Found;
+  }
+
+  class SpawnFinder : public ExprVisitor<SpawnFinder>
+  {
+  public:
+    bool Found = false;
+
+    using ExprVisitor::ExprVisitor;
+
+    void visitSpawn(ExprRef, const SpawnExpr &) { Found = true; }
+  };
+
+  static bool HasSpawns(const Tree &T, ExprRef E)
+  {
+    SpawnFinder Spawns(T);
+    Spawns.visit(E);
+    return Spawns.Found;
+  }
+
+  // What a Pizza::TaskGroup looks like to compiled code.
+  static StructType *getTaskGroupTy()
+  {
+    Type *I64 = Type::getInt64Ty(*TheContext);
+    return StructType::get(I64, I64);
+  }
+
+  // A base that spawns calls keeps track of them in its frame, which every
+  // spawn points the runtime to.
+  static AllocaInst *CreateTaskGroup(Function *TheFunction)
   {
     IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                      TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), 0,
-                             VarName.c_str());
+    AllocaInst *Alloca = TmpB.CreateAlloca(getTaskGroupTy(), 0, "spawns");
+    Type *I64 = Type::getInt64Ty(*TheContext);
+    TmpB.CreateStore(ConstantStruct::get(getTaskGroupTy(), {ConstantInt::get(I64, 0),
+                                                            ConstantInt::get(I64, -1, true)}),
+                     Alloca);
+    return Alloca;
+  }
+
+  // Waits for the calls spawned in Group. The runtime is only called if
+  // there were some since the last sync, which leaves the base's leaf
+  // calls a load and a branch.
+  static void EmitSync(AllocaInst *Group)
+  {
+    LLVMContext &C = *TheContext;
+    Value *Entry = Builder->CreateLoad(Type::getInt64Ty(C), Builder->CreateStructGEP(getTaskGroupTy(), Group, 1),
+                                       "spawned");
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *SyncBB = BasicBlock::Create(C, "sync", TheFunction);
+    BasicBlock *SyncedBB = BasicBlock::Create(C, "synced", TheFunction);
+    Builder->CreateCondBr(Builder->CreateICmpSGE(Entry, ConstantInt::get(Type::getInt64Ty(C), 0)), SyncBB, SyncedBB);
+    Builder->SetInsertPoint(SyncBB);
+    FunctionCallee Sync = TheModule->getOrInsertFunction(
+        "pizza_sync", Type::getVoidTy(C), Type::getInt8PtrTy(C));
+    Builder->CreateCall(Sync, {Builder->CreateBitCast(Group, Type::getInt8PtrTy(C))});
+    Builder->CreateBr(SyncedBB);
+    Builder->SetInsertPoint(SyncedBB);
+  }
+
+  // Frees the arrays allocated since ArenaMark. A spawned call may still be
+  // storing its result in one, so it is waited for first.
+  void CodeGen::releaseArena(Value *ArenaMark)
+  {
+    if (Group)
+      EmitSync(Group);
+    EmitArenaRelease(ArenaMark);
   }
 
-  Value *VarExprAST::codegen()
+  Value *CodeGen::visitVar(ExprRef E, const VarExpr &N)
   {
     Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
     // Register all variables and emit their initializer.
     Value *LastInitVal;
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
+    unsigned Index = 0;
+    for (const auto &Binding : T.getBindings(N.Bindings))
     {
-      const std::string &VarName = VarNames[i].first;
-      ExprAST *Init = VarNames[i].second.get();
+      Symbol VarName = Binding.Name;
+      bool IsInt = Types.isIntBinding(E, Index++);
+      if (Binding.Length)
+      {
+        Value *Length = visit(Binding.Length);
+        if (!Length)
+          return nullptr;
+        Length = toCount(Length, "length");
+        AllocaInst *Alloca = CreateArrayAlloca(TheFunction, VarName);
+        Value *Array = Builder->CreateInsertValue(UndefValue::get(getArrayTy()), EmitArenaAlloc(Length), 0);
+        Builder->CreateStore(Builder->CreateInsertValue(Array, Length, 1), Alloca);
+        LastInitVal = toNum(Length);
+        NamedValues.bind(VarName, Alloca);
+        continue;
+      }
+
+      // A spawned topping is 0 until the call's result lands in it.
+      if (Binding.Init && Binding.Init.getKind() == ExprKind::Spawn)
+      {
+        assert(!IsInt && "a spawned topping is never integral");
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+        LastInitVal = ConstantFP::get(getNumTy(), 0.0);
+        Builder->CreateStore(LastInitVal, Alloca);
+        if (!emitSpawn(T.get<SpawnExpr>(Binding.Init), [&]
+                       { return Alloca; }))
+          return nullptr;
+        NamedValues.bind(VarName, Alloca);
+        continue;
+      }
+
       Value *InitVal;
-      if (Init)
+      if (Binding.Init)
       {
-        InitVal = Init->codegen();
+        InitVal = visit(Binding.Init);
         if (!InitVal)
           return nullptr;
+        if (!IsInt)
+          InitVal = toNum(InitVal);
+      }
+      else if (IsInt)
+      { // If not specified, use 0.
+        InitVal = ConstantInt::get(Type::getInt64Ty(*TheContext), 0);
       }
       else
-      { // If not specified, use 0.0.
-        InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
+      {
+        InitVal = ConstantFP::get(getNumTy(), 0.0);
       }
 
-      AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+      AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, IsInt);
       Builder->CreateStore(InitVal, Alloca);
 
       LastInitVal = InitVal;
 
       // Remember this binding.
-      NamedValues[VarName] = std::move(Alloca);
+      NamedValues.bind(VarName, Alloca);
     }
 
-    if (Body)
+    if (N.Body)
     {
-      Value *BodyVal = Body->codegen();
+      Value *BodyVal = visit(N.Body);
       if (!BodyVal)
         return nullptr;
 
@@ -575,52 +928,237 @@ namespace
     }
   }
 
-  Value *VariableExprAST::codegen()
+  Value *CodeGen::visitVariable(ExprRef, const VariableExpr &N)
   {
-    Value *V = NamedValues[Name];
+    AllocaInst *V = NamedValues.lookup(N.Name);
     if (!V)
     {
       using namespace std::string_literals;
-      return LogErrorV(("Unknown variable name "s + Name).c_str());
+      return LogErrorV(("Unknown variable name "s + Symbols.name(N.Name).str()).c_str());
+    }
+    // An array's name stands for its length.
+    if (isArray(V))
+      return Builder->CreateExtractValue(Builder->CreateLoad(getArrayTy(), V, Symbols.name(N.Name)), 1, "length");
+    return Builder->CreateLoad(V->getAllocatedType(), V, Symbols.name(N.Name));
+  }
+
+  // Returns the address of an array element, checking it is in bounds
+  // unless the enclosing loop already did.
+  Value *CodeGen::emitElementPtr(ExprRef E, const IndexExpr &N)
+  {
+    AllocaInst *A = NamedValues.lookup(N.Array);
+    if (!A || !isArray(A))
+    {
+      using namespace std::string_literals;
+      return LogErrorV(("Unknown array name "s + Symbols.name(N.Array).str()).c_str());
     }
-    return Builder->CreateLoad(V, Name.c_str());
+
+    Value *Index = visit(N.Index);
+    if (!Index)
+      return nullptr;
+    Index = toCount(Index, "index");
+    Value *Array = Builder->CreateLoad(getArrayTy(), A, Symbols.name(N.Array));
+    if (!Unchecked.count(E.getRaw()))
+      EmitBoundsCheck(Index, Builder->CreateExtractValue(Array, 1, "length"));
+    return Builder->CreateInBoundsGEP(getNumTy(), Builder->CreateExtractValue(Array, 0), Index, "element");
   }
 
-  Value *NumberExprAST::codegen()
+  Value *CodeGen::visitIndex(ExprRef E, const IndexExpr &N)
   {
-    return ConstantFP::get(*TheContext, APFloat(Val));
+    Value *Ptr = emitElementPtr(E, N);
+    if (!Ptr)
+      return nullptr;
+    return Builder->CreateLoad(getNumTy(), Ptr, Symbols.name(N.Array));
   }
 
-  Value *BinaryExprAST::codegen()
+  // Spawns N's call, its result going to the address Dest returns once the
+  // arguments are evaluated. The call is outlined into
+  // <base>__spawn(args, dest), which the runtime queues for whichever
+  // thread gets to it first, unless it says to make the call right here.
+  bool CodeGen::emitSpawn(const SpawnExpr &N, function_ref<Value *()> Dest)
   {
-    if (Op == '=')
+    auto &Call = T.get<CallExpr>(N.Call);
+    Function *CalleeF = getFunction(Call.Callee);
+    if (!CalleeF)
     {
-      // Assignment requires the LHS to be an identifier.
-      VariableExprAST *LHSE = dynamic_cast<VariableExprAST *>(LHS.get());
-      if (!LHSE)
-        return LogErrorV("destination of '=' must be a variable");
+      using namespace std::string_literals;
+      LogErrorV(("Unknown function referenced "s + Symbols.name(Call.Callee).str()).c_str());
+      return false;
+    }
+    if (CalleeF->arg_size() != T.getList(Call.Args).size())
+    {
+      LogErrorV("Incorrect # arguments passed");
+      return false;
+    }
 
-      Value *Val = RHS->codegen();
-      if (!Val)
-        return nullptr;
+    std::vector<Value *> ArgsV;
+    if (!visitArgs(Call, ArgsV))
+      return false;
+    Value *DestPtr = Dest();
+    if (!DestPtr)
+      return false;
+
+    LLVMContext &C = *TheContext;
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    StructType *ArgsTy = StructType::get(C, std::vector<Type *>(ArgsV.size(), getNumTy()));
+    AllocaInst *Args = CreateEntryBlockAlloca(TheFunction, ArgsTy, "spawn.args");
+    for (unsigned I = 0; I < ArgsV.size(); I++)
+      Builder->CreateStore(toNum(ArgsV[I]), Builder->CreateStructGEP(ArgsTy, Args, I));
+
+    Type *PtrTy = Type::getInt8PtrTy(C);
+    FunctionType *ThunkTy = FunctionType::get(Type::getVoidTy(C), {PtrTy, PtrTy}, false);
+    Function *Thunk = Function::Create(ThunkTy, Function::ExternalLinkage,
+                                       TheFunction->getName() + "__spawn", TheModule.get());
+    ParallelBodies.push_back(Thunk);
+    {
+      IRBuilderBase::InsertPointGuard Guard(*Builder);
+      Builder->SetInsertPoint(BasicBlock::Create(C, "entry", Thunk));
+      Value *Copies = Builder->CreateBitCast(Thunk->getArg(0), ArgsTy->getPointerTo());
+      std::vector<Value *> Copied;
+      for (unsigned I = 0; I < ArgsV.size(); I++)
+        Copied.push_back(Builder->CreateLoad(getNumTy(), Builder->CreateStructGEP(ArgsTy, Copies, I)));
+      Builder->CreateStore(CreateNumCall(CalleeF, Copied, "calltmp"),
+                           Builder->CreateBitCast(Thunk->getArg(1), getNumTy()->getPointerTo()));
+      Builder->CreateRetVoid();
+    }
+
+    FunctionCallee Spawn = TheModule->getOrInsertFunction(
+        "pizza_spawn", Type::getInt32Ty(C), PtrTy, ThunkTy->getPointerTo(), PtrTy,
+        Type::getInt64Ty(C), PtrTy);
+    Value *Size = ConstantInt::get(Type::getInt64Ty(C), TheModule->getDataLayout().getTypeAllocSize(ArgsTy));
+    Value *Queued = Builder->CreateCall(
+        Spawn, {Builder->CreateBitCast(Group, PtrTy), Thunk, Builder->CreateBitCast(Args, PtrTy), Size,
+                Builder->CreateBitCast(DestPtr, PtrTy)},
+        "queued");
+
+    BasicBlock *CallBB = BasicBlock::Create(C, "spawn.call", TheFunction);
+    BasicBlock *SpawnedBB = BasicBlock::Create(C, "spawned", TheFunction);
+    Builder->CreateCondBr(Builder->CreateIsNull(Queued), CallBB, SpawnedBB);
+    Builder->SetInsertPoint(CallBB);
+    Builder->CreateStore(CreateNumCall(CalleeF, ArgsV, "calltmp"), DestPtr);
+    Builder->CreateBr(SpawnedBB);
+    Builder->SetInsertPoint(SpawnedBB);
+    return true;
+  }
+
+  // A spawn is only meaningful as what '=' or a topping's initializer
+  // stores, which emitSpawn handles there.
+  Value *CodeGen::visitSpawn(ExprRef, const SpawnExpr &)
+  {
+    return LogErrorV("spawn needs a topping or an array element to put its result in");
+  }
+
+  Value *CodeGen::visitSync(ExprRef, const SyncExpr &)
+  {
+    if (Group)
+      EmitSync(Group);
+    return ConstantFP::get(getNumTy(), 0.0);
+  }
+
+  Value *CodeGen::visitNumber(ExprRef E, const NumberExpr &N)
+  {
+    if (Types.isInt(E))
+      return ConstantInt::get(Type::getInt64Ty(*TheContext), (int64_t)N.Val, true);
+    return ConstantFP::get(getNumTy(), N.Val);
+  }
+
+  Value *CodeGen::visitBinary(ExprRef E, const BinaryExpr &N)
+  {
+    char Op = N.Op;
+    if (Op == '=' && N.RHS.getKind() == ExprKind::Spawn)
+    {
+      // The assignment happens when the call is done; until then it is 0.
+      auto Dest = [&]() -> Value *
+      {
+        if (N.LHS.getKind() == ExprKind::Index)
+          return emitElementPtr(N.LHS, T.get<IndexExpr>(N.LHS));
+        if (N.LHS.getKind() != ExprKind::Variable)
+          return LogErrorV("destination of '=' must be a variable or an array element");
+        Symbol Name = T.get<VariableExpr>(N.LHS).Name;
+        AllocaInst *Variable = NamedValues.lookup(Name);
+        if (!Variable)
+        {
+          using namespace std::string_literals;
+          return LogErrorV(("Unknown variable name "s + Symbols.name(Name).str()).c_str());
+        }
+        if (isArray(Variable))
+          return LogErrorV("cannot assign to an array");
+        assert(!Variable->getAllocatedType()->isIntegerTy() && "a spawned topping is never integral");
+        return Variable;
+      };
+      if (!emitSpawn(T.get<SpawnExpr>(N.RHS), Dest))
+        return nullptr;
+      return ConstantFP::get(getNumTy(), 0.0);
+    }
+    if (Op == '=')
+    {
+      if (N.LHS.getKind() == ExprKind::Index)
+      {
+        Value *Val = visit(N.RHS);
+        if (!Val)
+          return nullptr;
+        Value *Ptr = emitElementPtr(N.LHS, T.get<IndexExpr>(N.LHS));
+        if (!Ptr)
+          return nullptr;
+        Val = toNum(Val);
+        Builder->CreateStore(Val, Ptr);
+        return Val;
+      }
+
+      // Assignment requires the LHS to be an identifier.
+      if (N.LHS.getKind() != ExprKind::Variable)
+        return LogErrorV("destination of '=' must be a variable or an array element");
+      Symbol Name = T.get<VariableExpr>(N.LHS).Name;
+
+      Value *Val = visit(N.RHS);
+      if (!Val)
+        return nullptr;
 
       // Look up the name.
-      Value *Variable = NamedValues[LHSE->getName()];
+      AllocaInst *Variable = NamedValues.lookup(Name);
       if (!Variable)
       {
         using namespace std::string_literals;
-        return LogErrorV(("Unknown variable name "s + LHSE->getName()).c_str());
+        return LogErrorV(("Unknown variable name "s + Symbols.name(Name).str()).c_str());
       }
+      if (isArray(Variable))
+        return LogErrorV("cannot assign to an array");
 
+      // Integral variables are only ever assigned integral values.
+      if (!Variable->getAllocatedType()->isIntegerTy())
+        Val = toNum(Val);
+      assert(Val->getType() == Variable->getAllocatedType() && "assignment type mismatch");
       Builder->CreateStore(Val, Variable);
       return Val;
     }
 
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
+    auto Acc = Tail.Accumulated.find(E.getRaw());
+    if (Acc != Tail.Accumulated.end())
+      return emitAccumulate(N, Acc->second);
+
+    Value *L = visit(N.LHS);
+    Value *R = visit(N.RHS);
     if (!L || !R)
       return nullptr;
 
+    if (Types.isInt(E))
+    {
+      switch (Op)
+      {
+      case '+':
+        return Builder->CreateAdd(L, R, "addtmp");
+      case '-':
+        return Builder->CreateSub(L, R, "subtmp");
+      case '<':
+        L = Builder->CreateICmpSLT(L, R, "cmptmp");
+        return Builder->CreateZExt(L, Type::getInt64Ty(*TheContext), "booltmp");
+      default:
+        llvm_unreachable("only +, - and < have integral results");
+      }
+    }
+
+    L = toNum(L);
+    R = toNum(R);
     switch (Op)
     {
     case '+':
@@ -634,64 +1172,522 @@ namespace
     case '<':
       L = Builder->CreateFCmpULT(L, R, "cmptmp");
       // Convert bool 0/1 to double 0.0 or 1.0
-      return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
-                                   "booltmp");
+      return Builder->CreateUIToFP(L, getNumTy(), "booltmp");
     default:
       break;
     }
 
-    Function *F = getFunction(std::string("binary") + Op);
+    Function *F = getFunction(getOperatorSymbol(true, Op));
     assert(F && "binary operator not found!");
 
     Value *Ops[2] = {L, R};
-    return Builder->CreateCall(F, Ops, "binop");
+    return CreateNumCall(F, Ops, "binop");
+  }
+
+  // Bitcode of each base's optimized definition, as an available_externally
+  // copy. Modules that call a base import its body so the inliner can see
+  // it; calls left over still go to the definition the JIT already has.
+  static StringMap<std::string> OptimizedBodies;
+
+  // Bases containing a for loop, which call-site specialization can give a
+  // known trip count.
+  static DenseSet<Symbol> LoopingBases;
+
+  // Clones of bases specialized for constant arguments, made in the calling
+  // module and optimized along with it. Only bases with a loop are
+  // specialized, as they gain known trip counts, and only where their
+  // optimized body was kept for inlining. Each base gets at most
+  // MaxSpecializations clones over the whole program to bound code size.
+  static const unsigned MaxSpecializations = 8;
+  static StringMap<unsigned> SpecializationCounts;
+  // Clones in TheModule, keyed on the base and the constant arguments.
+  static StringMap<Function *> ModuleSpecializations;
+
+  // Returns a clone of Callee with the constant arguments in Args folded in,
+  // and leaves only the remaining arguments in Args; or null to call the
+  // generic body.
+  static Function *SpecializeCall(Function *Callee, std::vector<Value *> &Args)
+  {
+    if (!TheMPM || !TheMPM->inlines() || wholeProgram ||
+        !LoopingBases.count(Symbols.intern(Callee->getName())))
+      return nullptr;
+
+    std::string Key = Callee->getName().str();
+    bool AnyConstant = false;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    {
+      Args[i] = convertTo(Args[i], Callee->getFunctionType()->getParamType(i));
+      Key += ',';
+      if (auto *C = dyn_cast<ConstantFP>(Args[i]))
+      {
+        Key += utohexstr(C->getValueAPF().bitcastToAPInt().getZExtValue());
+        AnyConstant = true;
+      }
+    }
+    if (!AnyConstant)
+      return nullptr;
+
+    Function *&Spec = ModuleSpecializations[Key];
+    if (!Spec)
+    {
+      auto Body = OptimizedBodies.find(Callee->getName());
+      unsigned &Count = SpecializationCounts[Callee->getName()];
+      if (Body == OptimizedBodies.end() || Count >= MaxSpecializations)
+      {
+        ModuleSpecializations.erase(Key);
+        return nullptr;
+      }
+
+      auto M = parseBitcodeFile(MemoryBufferRef(Body->second, Body->first()), *TheContext);
+      if (!M)
+      {
+        consumeError(M.takeError());
+        ModuleSpecializations.erase(Key);
+        return nullptr;
+      }
+      Function *Source = (*M)->getFunction(Callee->getName());
+      ValueToValueMapTy VMap;
+      for (unsigned i = 0, e = Args.size(); i != e; ++i)
+        if (isa<ConstantFP>(Args[i]))
+          VMap[Source->getArg(i)] = Args[i];
+      Spec = CloneFunction(Source, VMap);
+
+      // Point the clone's calls at TheModule's functions, and its memo
+      // table at TheModule's declaration of it, and move it over.
+      for (GlobalVariable &G : (*M)->globals())
+        G.replaceAllUsesWith(TheModule->getOrInsertGlobal(G.getName(), G.getValueType()));
+      for (Function &F : **M)
+      {
+        if (&F == Spec)
+          continue;
+        Function *Target = getFunction(Symbols.intern(F.getName()));
+        if (Target)
+          F.replaceAllUsesWith(Target);
+        else
+          F.replaceAllUsesWith(TheModule->getOrInsertFunction(F.getName(), F.getFunctionType()).getCallee());
+      }
+      Spec->removeFromParent();
+      TheModule->getFunctionList().push_back(Spec);
+      Spec->setLinkage(GlobalValue::InternalLinkage);
+      Spec->setName(Callee->getName() + ".spec");
+      Count++;
+    }
+
+    Args.erase(std::remove_if(Args.begin(), Args.end(), [](Value *V)
+                              { return isa<ConstantFP>(V); }),
+               Args.end());
+    return Spec;
+  }
+
+  // Applies what the skipped tail calls accumulated to a result.
+  static Value *ApplyAccumulator(const TailRecursion &Tail, Value *V)
+  {
+    if (!Tail.Acc)
+      return V;
+    Value *Acc = Builder->CreateLoad(getNumTy(), Tail.Acc, "acc");
+    return Tail.AccOp == '+' ? Builder->CreateFAdd(Acc, toNum(V), "acc.add")
+                             : Builder->CreateFMul(Acc, toNum(V), "acc.mul");
+  }
+
+  bool CodeGen::visitArgs(const CallExpr &N, std::vector<Value *> &ArgsV)
+  {
+    for (ExprRef Arg : T.getList(N.Args))
+    {
+      Value *ArgV = visit(Arg);
+      if (!ArgV)
+        return false;
+      ArgsV.push_back(ArgV);
+    }
+    return true;
+  }
+
+  // Rebinds the parameters to a tail call's arguments and starts the body
+  // over. What follows the jump is unreachable; it still gets a block, and
+  // a value, so the enclosing expressions can be emitted as usual.
+  Value *CodeGen::emitTailJump(ArrayRef<Value *> ArgsV)
+  {
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+      Builder->CreateStore(toNum(ArgsV[i]), Tail.Params[i]);
+    if (Group)
+      EmitSync(Group);
+    if (Tail.ArenaMark)
+      EmitArenaRelease(Tail.ArenaMark);
+    Builder->CreateBr(Tail.Header);
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "aftertail", TheFunction));
+    return UndefValue::get(getNumTy());
   }
 
-  Value *CallExprAST::codegen()
+  Value *CodeGen::emitAccumulate(const BinaryExpr &N, bool CallOnLHS)
+  {
+    auto &Call = T.get<CallExpr>(CallOnLHS ? N.LHS : N.RHS);
+    std::vector<Value *> ArgsV;
+    // Keep the operands' evaluation order. A call on the LHS returns before
+    // the RHS runs, and the RHS is pure, so evaluating it before the jump
+    // is the same.
+    if (CallOnLHS && !visitArgs(Call, ArgsV))
+      return nullptr;
+    Value *V = visit(CallOnLHS ? N.RHS : N.LHS);
+    if (!V)
+      return nullptr;
+    if (!CallOnLHS && !visitArgs(Call, ArgsV))
+      return nullptr;
+
+    Builder->CreateStore(ApplyAccumulator(Tail, V), Tail.Acc);
+    return emitTailJump(ArgsV);
+  }
+
+  Value *CodeGen::visitCall(ExprRef E, const CallExpr &N)
   {
     // Look up the name in the global module table.
-    Function *CalleeF = getFunction(Callee);
+    Function *CalleeF = getFunction(N.Callee);
     if (!CalleeF)
     {
       using namespace std::string_literals;
-      return LogErrorV(("Unknown function referenced "s + Callee).c_str());
+      return LogErrorV(("Unknown function referenced "s + Symbols.name(N.Callee).str()).c_str());
     }
 
     // If argument mismatch error.
-    if (CalleeF->arg_size() != Args.size())
+    if (CalleeF->arg_size() != T.getList(N.Args).size())
       return LogErrorV("Incorrect # arguments passed");
 
     std::vector<Value *> ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (!visitArgs(N, ArgsV))
+      return nullptr;
+
+    if (Tail.Calls.count(E.getRaw()))
+      return emitTailJump(ArgsV);
+
+    // Math sauces work in the precision of the program, so under
+    // --precision=f32 sin is sinf.
+    Intrinsic::ID IID = GetMathIntrinsic(N.Callee, ArgsV.size());
+    if (IID != Intrinsic::not_intrinsic)
     {
-      ArgsV.push_back(Args[i]->codegen());
-      if (!ArgsV.back())
-        return nullptr;
+      for (Value *&ArgV : ArgsV)
+        ArgV = toNum(ArgV);
+      Function *F = Intrinsic::getDeclaration(TheModule.get(), IID, getNumTy());
+      return Builder->CreateCall(F, ArgsV, "calltmp");
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    if (Function *Spec = SpecializeCall(CalleeF, ArgsV))
+      return CreateNumCall(Spec, ArgsV, "calltmp");
+    return CreateNumCall(CalleeF, ArgsV, "calltmp");
   }
 
   Function *PrototypeAST::codegen()
   {
+    // A repeated declaration refers to the function already in the module.
+    if (Function *F = ModuleFunctions.lookup(Name))
+      return F;
+
     // Make the function type:  double(double,double) etc.
-    std::vector<Type *> Doubles(Args.size(),
-                                Type::getDoubleTy(*TheContext));
-    FunctionType *FT =
-        FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+    Type *Ty = HostABI ? Type::getDoubleTy(*TheContext) : getNumTy();
+    std::vector<Type *> Params(Args.size(), Ty);
+    FunctionType *FT = FunctionType::get(Ty, Params, false);
 
     Function *F =
-        Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+        Function::Create(FT, Function::ExternalLinkage, Symbols.name(Name), TheModule.get());
+    ModuleFunctions[Name] = F;
 
     unsigned Idx = 0;
     for (auto &Arg : F->args())
-      Arg.setName(Args[Idx++]);
+      Arg.setName(Symbols.name(Args[Idx++]));
 
     return F;
   }
 
-  Function *FunctionAST::codegen()
+  // Bases whose result depends only on their arguments: they call nothing
+  // but themselves and other pure bases, so no sauce with side effects.
+  static DenseSet<Symbol> PureBases;
+  // Bases named by --memoize=...; empty means every pure base that calls a
+  // base, except those whose recursion all turns into a loop. Leaf bases are
+  // cheaper to recompute than to look up.
+  static DenseSet<Symbol> MemoizeBases;
+  static std::vector<std::pair<Symbol, std::unique_ptr<Pizza::MemoTable>>> MemoTables;
+
+  static bool IsPureBase(Symbol Name) { return PureBases.count(Name); }
+
+  // Whether an expression calls only Self and the bases Known says are
+  // pure, by default those in PureBases.
+  class PurityChecker : public ExprVisitor<PurityChecker>
+  {
+  private:
+    Symbol Self;
+    function_ref<bool(Symbol)> Known;
+
+    void callee(Symbol Name)
+    {
+      MakesCalls = true;
+      if (Name != Self && !Known(Name))
+        Pure = false;
+    }
+
+  public:
+    bool Pure = true;
+    bool MakesCalls = false;
+    unsigned SelfCalls = 0;
+
+    PurityChecker(const Tree &T, Symbol Self, function_ref<bool(Symbol)> Known = IsPureBase)
+        : ExprVisitor(T), Self(Self), Known(Known) {}
+
+    void visitCall(ExprRef E, const CallExpr &N)
+    {
+      if (N.Callee == Self)
+        SelfCalls++;
+      if (GetMathIntrinsic(N.Callee, T.getList(N.Args).size()) == Intrinsic::not_intrinsic)
+        callee(N.Callee);
+      visitExpr(E);
+    }
+
+    void visitBinary(ExprRef E, const BinaryExpr &N)
+    {
+      if (!strchr("=<+-*/", N.Op))
+        callee(getOperatorSymbol(true, N.Op));
+      visitExpr(E);
+    }
+
+    void visitUnary(ExprRef E, const UnaryExpr &N)
+    {
+      callee(getOperatorSymbol(false, N.Opcode));
+      visitExpr(E);
+    }
+  };
+
+  // Compiled code refers to the memo table of a base through an external
+  // global named "<base>.memo", which the JIT binds to the host table. Base
+  // names have no '.', so it never clashes with one.
+  static std::string MemoTableName(Symbol Base)
+  {
+    return (Symbols.name(Base) + ".memo").str();
+  }
+
+  static Constant *MemoTableRef(Symbol Base)
+  {
+    return TheModule->getOrInsertGlobal(MemoTableName(Base), Type::getInt8Ty(*TheContext));
+  }
+
+  // Starts a memoized base: looks the current values of its Params up,
+  // returning the cached result from F on a hit and otherwise continuing in
+  // a new block. Returns the argument array the result is stored under on
+  // return.
+  static Value *EmitMemoLookup(Function *F, Symbol Base, ArrayRef<AllocaInst *> Params)
+  {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *ArgsTy = ArrayType::get(DoubleTy, std::max<size_t>(Params.size(), 1));
+    AllocaInst *Args = CreateEntryBlockAlloca(F, ArgsTy, "memo.args");
+    unsigned Idx = 0;
+    for (AllocaInst *Param : Params)
+      Builder->CreateStore(convertTo(Builder->CreateLoad(getNumTy(), Param), DoubleTy),
+                           Builder->CreateConstGEP2_32(ArgsTy, Args, 0, Idx++));
+    Value *ArgsPtr = Builder->CreateConstGEP2_32(ArgsTy, Args, 0, 0);
+
+    FunctionCallee Lookup = TheModule->getOrInsertFunction(
+        "pizza_memo_lookup", Type::getDoublePtrTy(*TheContext),
+        Type::getInt8PtrTy(*TheContext), Type::getDoublePtrTy(*TheContext));
+    Value *Slot = Builder->CreateCall(Lookup, {MemoTableRef(Base), ArgsPtr}, "memo.slot");
+
+    BasicBlock *HitBB = BasicBlock::Create(*TheContext, "memo.hit", F);
+    BasicBlock *MissBB = BasicBlock::Create(*TheContext, "memo.miss", F);
+    Builder->CreateCondBr(Builder->CreateIsNotNull(Slot), HitBB, MissBB);
+    Builder->SetInsertPoint(HitBB);
+    Value *Cached = Builder->CreateLoad(Type::getDoubleTy(*TheContext), Slot, "memo.value");
+    Builder->CreateRet(convertTo(Cached, F->getReturnType()));
+    Builder->SetInsertPoint(MissBB);
+    return ArgsPtr;
+  }
+
+  static void EmitMemoStore(Symbol Base, Value *ArgsPtr, Value *Result)
+  {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    FunctionCallee Store = TheModule->getOrInsertFunction(
+        "pizza_memo_store", Type::getVoidTy(*TheContext), Type::getInt8PtrTy(*TheContext),
+        Type::getDoublePtrTy(*TheContext), DoubleTy);
+    Builder->CreateCall(Store, {MemoTableRef(Base), ArgsPtr, convertTo(Result, DoubleTy)});
+  }
+
+  class LoopFinder : public ExprVisitor<LoopFinder>
+  {
+  public:
+    bool Found = false;
+
+    using ExprVisitor::ExprVisitor;
+
+    void visitFor(ExprRef, const ForExpr &) { Found = true; }
+  };
+
+  // Fills in the tail calls of a body; see TailRecursion.
+  class TailCallFinder
+  {
+  private:
+    const Tree &T;
+    Symbol Self;
+    size_t NumArgs;
+    bool Accumulate;
+    TailRecursion &R;
+
+    bool isSelfCall(ExprRef E) const
+    {
+      if (E.getKind() != ExprKind::Call)
+        return false;
+      auto &N = T.get<CallExpr>(E);
+      return N.Callee == Self && T.getList(N.Args).size() == NumArgs;
+    }
+
+    // Whether the other operand of an accumulating node may be evaluated
+    // before the recursion instead of after it.
+    bool isPure(ExprRef E) const
+    {
+      PurityChecker Checker(T, NoSymbol);
+      Checker.visit(E);
+      return Checker.Pure;
+    }
+
+  public:
+    TailCallFinder(const Tree &T, Symbol Self, size_t NumArgs, bool Accumulate, TailRecursion &R)
+        : T(T), Self(Self), NumArgs(NumArgs), Accumulate(Accumulate), R(R) {}
+
+    void visit(ExprRef E)
+    {
+      switch (E.getKind())
+      {
+      case ExprKind::Call:
+        if (isSelfCall(E))
+          R.Calls.insert(E.getRaw());
+        break;
+      case ExprKind::If:
+      {
+        auto &N = T.get<IfExpr>(E);
+        visit(N.Then);
+        visit(N.Else);
+        break;
+      }
+      case ExprKind::Var:
+      {
+        auto &N = T.get<VarExpr>(E);
+        if (N.Body)
+          visit(N.Body);
+        break;
+      }
+      case ExprKind::Scope:
+      {
+        auto Body = T.getList(T.get<ScopeExpr>(E).Body);
+        if (!Body.empty())
+          visit(Body.back());
+        break;
+      }
+      case ExprKind::Binary:
+      {
+        auto &N = T.get<BinaryExpr>(E);
+        if (!Accumulate || (N.Op != '+' && N.Op != '*') || (R.AccOp && R.AccOp != N.Op))
+          break;
+        if (isSelfCall(N.RHS))
+          R.Accumulated[E.getRaw()] = false;
+        else if (isSelfCall(N.LHS) && isPure(N.RHS))
+          R.Accumulated[E.getRaw()] = true;
+        else
+          break;
+        R.AccOp = N.Op;
+        break;
+      }
+      default:
+        break;
+      }
+    }
+  };
+
+  // Whether every call a base makes to itself becomes a jump back to the
+  // top, accumulating or not. Each call then has new arguments, so a table
+  // would only be filled, never hit, and memoizing would cost the
+  // accumulator loop.
+  static bool LoopsOnItself(const Tree &T, const PrototypeAST &P, ExprRef Body,
+                            const PurityChecker &Checker)
+  {
+    if (!Checker.SelfCalls)
+      return false;
+    TailRecursion R;
+    TailCallFinder(T, P.getName(), P.getArgs().size(), true, R).visit(Body);
+    return R.Calls.size() + R.Accumulated.size() == Checker.SelfCalls;
+  }
+
+  // Decides whether a definition is memoized, recording it as pure if it is.
+  static Pizza::MemoTable *GetMemoTable(const Tree &T, const PrototypeAST &P, ExprRef Body)
+  {
+    Symbol Name = P.getName();
+    if (!memoize || Name == AnonExprSym)
+      return nullptr;
+
+    PurityChecker Checker(T, Name);
+    Checker.visit(Body);
+    bool Named = MemoizeBases.count(Name);
+    if (!Checker.Pure)
+    {
+      if (Named)
+        fprintf(stderr, "Not memoizing base '%s': it is not pure\n", Symbols.name(Name).str().c_str());
+      return nullptr;
+    }
+    PureBases.insert(Name);
+    if (MemoizeBases.empty() ? !Checker.MakesCalls || LoopsOnItself(T, P, Body, Checker) : !Named)
+      return nullptr;
+
+    MemoTables.emplace_back(Name, std::make_unique<Pizza::MemoTable>(P.getArgs().size()));
+    ExitOnErr(TheJIT->defineAbsolute(MemoTableName(Name), MemoTables.back().second.get()));
+    return MemoTables.back().second.get();
+  }
+
+  // Adds "name__batch(const double *in, double *out, size_t n)" next to a
+  // base F, setting out[i] = F(in[i], in[n + i], ...) for every i < n. Each
+  // parameter has its own array, so lanes load contiguously, and nothing
+  // aliases, so the vectorizer can run the loop at the target's vector
+  // width once F is inlined, if-converting its branches into selects.
+  static Function *EmitBatchVariant(Function *F)
+  {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *PtrTy = DoubleTy->getPointerTo();
+    Type *SizeTy = Type::getInt64Ty(*TheContext);
+    FunctionType *FT = FunctionType::get(Type::getVoidTy(*TheContext), {PtrTy, PtrTy, SizeTy}, false);
+    Function *Batch = Function::Create(FT, Function::ExternalLinkage, F->getName() + "__batch", TheModule.get());
+    Argument *In = Batch->getArg(0), *Out = Batch->getArg(1), *N = Batch->getArg(2);
+    In->setName("in");
+    Out->setName("out");
+    N->setName("n");
+    for (unsigned Idx : {0, 1})
+    {
+      Batch->addParamAttr(Idx, Attribute::NoAlias);
+      Batch->addParamAttr(Idx, Attribute::NoCapture);
+    }
+    Batch->addParamAttr(0, Attribute::ReadOnly);
+
+    BasicBlock *Entry = BasicBlock::Create(*TheContext, "entry", Batch);
+    BasicBlock *Loop = BasicBlock::Create(*TheContext, "loop", Batch);
+    BasicBlock *Exit = BasicBlock::Create(*TheContext, "exit", Batch);
+    Builder->SetInsertPoint(Entry);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(N, ConstantInt::get(SizeTy, 0)), Exit, Loop);
+
+    Builder->SetInsertPoint(Loop);
+    PHINode *I = Builder->CreatePHI(SizeTy, 2, "i");
+    I->addIncoming(ConstantInt::get(SizeTy, 0), Entry);
+    std::vector<Value *> ArgsV;
+    for (unsigned Arg = 0, E = F->arg_size(); Arg != E; ++Arg)
+    {
+      Value *Index = Builder->CreateAdd(Builder->CreateMul(N, ConstantInt::get(SizeTy, Arg)), I);
+      Value *Ptr = Builder->CreateInBoundsGEP(DoubleTy, In, Index);
+      ArgsV.push_back(Builder->CreateLoad(Type::getDoubleTy(*TheContext), Ptr, "arg"));
+    }
+    Value *Result = convertTo(CreateNumCall(F, ArgsV, "calltmp"), DoubleTy);
+    Builder->CreateStore(Result, Builder->CreateInBoundsGEP(DoubleTy, Out, I));
+    Value *Next = Builder->CreateNUWAdd(I, ConstantInt::get(SizeTy, 1), "next");
+    I->addIncoming(Next, Loop);
+    Builder->CreateCondBr(Builder->CreateICmpULT(Next, N), Loop, Exit);
+
+    Builder->SetInsertPoint(Exit);
+    Builder->CreateRetVoid();
+    return Batch;
+  }
+
+  Function *FunctionAST::codegen(const Tree &T)
   {
+    Proto->setHostABI(Name == AnonExprSym || HasHostABI(Name));
     auto &P = *Proto;
     FunctionProtos[P.getName()] = std::move(Proto);
     Function *TheFunction = getFunction(P.getName());
@@ -699,50 +1695,144 @@ namespace
     if (!TheFunction)
       return nullptr;
 
+    // Only --whole-program sees an earlier definition here; otherwise each
+    // definition gets a fresh module.
+    if (!TheFunction->empty())
+    {
+      LogErrorV("Function cannot be redefined");
+      return nullptr;
+    }
+
     if (P.isBinaryOp())
       BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    bool NewBase = DefinedBases.insert(P.getName()).second;
 
     BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
     Builder->SetInsertPoint(BB);
+    ParallelBodies.clear();
 
-    StoreNamedValues(false);
+    // Functions are only generated at the top level, so nothing else is in
+    // scope here.
+    assert(NamedValues.empty() && "function body nested in another scope");
+    NamedValues.enterScope();
+    TailRecursion Tail;
+    unsigned Idx = 0;
     for (auto &Arg : TheFunction->args())
     {
-      AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, std::string(Arg.getName()));
-      Builder->CreateStore(&Arg, Alloca);
-      NamedValues[std::string(Arg.getName())] = std::move(Alloca);
+      Symbol ArgName = P.getArgs()[Idx++];
+      AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, ArgName);
+      Builder->CreateStore(toNum(&Arg), Alloca);
+      Tail.Params.push_back(Alloca);
+      // A repeated parameter name refers to the first parameter.
+      if (!NamedValues.lookup(ArgName))
+        NamedValues.bind(ArgName, Alloca);
     }
 
-    if (Value *RetVal = Body->codegen())
+    // Memoized bases look every iteration's arguments up, so their loop
+    // starts before the lookup. They don't accumulate: only the last
+    // iteration's result would be stored, leaving the table almost empty.
+    Pizza::MemoTable *Memo = GetMemoTable(T, P, Body);
+    if (P.getName() != AnonExprSym)
+      TailCallFinder(T, P.getName(), P.getArgs().size(), !Memo, Tail).visit(Body);
+    if (DeclaresArrays(T, Body))
+      Tail.ArenaMark = EmitArenaMark();
+    if (!Tail.empty())
     {
-      // Finish off the function.
-      Builder->CreateRet(RetVal);
+      if (Tail.AccOp)
+      {
+        Tail.Acc = CreateEntryBlockAlloca(TheFunction, getNumTy(), "acc");
+        Builder->CreateStore(ConstantFP::get(getNumTy(), Tail.AccOp == '+' ? 0.0 : 1.0), Tail.Acc);
+      }
+      Tail.Header = BasicBlock::Create(*TheContext, "tailrecurse", TheFunction);
+      Builder->CreateBr(Tail.Header);
+      Builder->SetInsertPoint(Tail.Header);
+    }
+    Value *MemoArgs = Memo ? EmitMemoLookup(TheFunction, P.getName(), Tail.Params) : nullptr;
+    AllocaInst *Group = HasSpawns(T, Body) ? CreateTaskGroup(TheFunction) : nullptr;
 
-      // Validate the generated code, checking for consistency.
-      verifyFunction(*TheFunction, &errs());
+    IntegerTypes Types;
+    Types.run(T, P.getArgs(), Body, getMaxExact());
+    if (Value *RetVal = CodeGen(T, Types, Tail, Group).visit(Body))
+    {
+      // Finish off the function. Calls it spawned may still be storing
+      // their results in its toppings and arrays.
+      RetVal = ApplyAccumulator(Tail, RetVal);
+      if (Group)
+        EmitSync(Group);
+      if (Tail.ArenaMark)
+        EmitArenaRelease(Tail.ArenaMark);
+      if (Memo)
+        EmitMemoStore(P.getName(), MemoArgs, RetVal);
+      Builder->CreateRet(convertTo(RetVal, TheFunction->getReturnType()));
+
+      // Validate the generated code, checking for consistency. The fast
+      // compile mode only pays for this in debug builds.
+#ifdef NDEBUG
+      if (!fastCompile)
+#endif
+      {
+        verifyFunction(*TheFunction, &errs());
+        for (Function *Body : ParallelBodies)
+          verifyFunction(*Body, &errs());
+      }
 
       // Optimize the function.
-      TheFPM->run(*TheFunction);
+      if (TheFPM)
+      {
+        TheFPM->run(*TheFunction);
+        for (Function *Body : ParallelBodies)
+          TheFPM->run(*Body);
+      }
+
+      LoopFinder Loops(T);
+      Loops.visit(Body);
+      if (Loops.Found)
+        LoopingBases.insert(P.getName());
+
+      // Only straight-line bases vectorize: no loops, and no calls but to
+      // math intrinsics.
+      if (emitBatch && !Memo && P.getName() != AnonExprSym && !Loops.Found)
+      {
+        PurityChecker Checker(T, NoSymbol);
+        Checker.visit(Body);
+        if (Checker.Pure && !Checker.MakesCalls)
+          EmitBatchVariant(TheFunction);
+      }
 
-      RestoreNamedValues();
+      NamedValues.exitScope();
 
       return TheFunction;
     }
 
-    RestoreNamedValues();
+    NamedValues.exitScope();
 
+    if (Memo)
+    {
+      ExitOnErr(TheJIT->remove(MemoTableName(P.getName())));
+      MemoTables.pop_back();
+    }
+    PureBases.erase(P.getName());
+    if (NewBase)
+      DefinedBases.erase(P.getName());
+    ModuleFunctions.erase(P.getName());
+    // The bodies may call the base, which refers to them in turn.
+    for (Function *Body : ParallelBodies)
+      Body->dropAllReferences();
     TheFunction->eraseFromParent();
+    for (Function *Body : ParallelBodies)
+      Body->eraseFromParent();
+    ParallelBodies.clear();
     return nullptr;
   }
 
-  Value *IfExprAST::codegen()
+  Value *CodeGen::visitIf(ExprRef E, const IfExpr &N)
   {
-    Value *CondV = Cond->codegen();
+    Value *CondV = visit(N.Cond);
     if (!CondV)
       return nullptr;
 
-    CondV = Builder->CreateFCmpONE(
-        CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+    CondV = isTrue(CondV, "ifcond");
+    bool IsInt = Types.isInt(E);
 
     Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
@@ -754,9 +1844,11 @@ namespace
     Builder->CreateCondBr(CondV, ThenBB, ElseBB);
     Builder->SetInsertPoint(ThenBB);
 
-    Value *ThenV = Then->codegen();
+    Value *ThenV = visit(N.Then);
     if (!ThenV)
       return nullptr;
+    if (!IsInt)
+      ThenV = toNum(ThenV);
 
     Builder->CreateBr(MergeBB);
 
@@ -764,143 +1856,1454 @@ namespace
     TheFunction->getBasicBlockList().push_back(ElseBB);
     Builder->SetInsertPoint(ElseBB);
 
-    Value *ElseV = Else->codegen();
+    Value *ElseV = visit(N.Else);
     if (!ElseV)
       return nullptr;
+    if (!IsInt)
+      ElseV = toNum(ElseV);
 
     Builder->CreateBr(MergeBB);
     // codegen of 'Else' can change the current block, update ElseBB for the PHI.
     ElseBB = Builder->GetInsertBlock();
     TheFunction->getBasicBlockList().push_back(MergeBB);
     Builder->SetInsertPoint(MergeBB);
-    PHINode *PN =
-        Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+    PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
     return PN;
   }
 
-  Value *ForExprAST::codegen()
-  {
-    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  // Names a loop body or step assigns, including ones declared inside it,
+  // which is enough to tell what stays unchanged across iterations.
+  class AssignmentFinder : public ExprVisitor<AssignmentFinder>
+  {
+  public:
+    DenseSet<Symbol> Assigned;
+
+    using ExprVisitor::ExprVisitor;
+
+    void visitBinary(ExprRef E, const BinaryExpr &N)
+    {
+      if (N.Op == '=' && N.LHS.getKind() == ExprKind::Variable)
+        Assigned.insert(T.get<VariableExpr>(N.LHS).Name);
+      visitExpr(E);
+    }
+
+    void visitFor(ExprRef E, const ForExpr &N)
+    {
+      Assigned.insert(N.VarName);
+      visitExpr(E);
+    }
+
+    void visitVar(ExprRef E, const VarExpr &N)
+    {
+      for (const auto &VB : T.getBindings(N.Bindings))
+        Assigned.insert(VB.Name);
+      visitExpr(E);
+    }
+  };
+
+  // Whether E is arithmetic over numbers and variables the loop leaves
+  // alone, so it has the same value on every iteration.
+  static bool IsLoopInvariant(const Tree &T, ExprRef E, const DenseSet<Symbol> &Assigned)
+  {
+    switch (E.getKind())
+    {
+    case ExprKind::Number:
+      return true;
+    case ExprKind::Variable:
+      return !Assigned.count(T.get<VariableExpr>(E).Name);
+    case ExprKind::Binary:
+    {
+      auto &N = T.get<BinaryExpr>(E);
+      return strchr("+-*/", N.Op) && IsLoopInvariant(T, N.LHS, Assigned) &&
+             IsLoopInvariant(T, N.RHS, Assigned);
+    }
+    default:
+      return false;
+    }
+  }
+
+  // The value a reduction starts from, which an empty loop evaluates to.
+  static Value *GetReductionIdentity(Reduction R)
+  {
+    switch (R)
+    {
+    case Reduction::Sum:
+      return ConstantFP::get(getNumTy(), 0.0);
+    case Reduction::Product:
+      return ConstantFP::get(getNumTy(), 1.0);
+    case Reduction::Min:
+      return ConstantFP::getInfinity(getNumTy());
+    case Reduction::Max:
+      return ConstantFP::getInfinity(getNumTy(), /*Negative=*/true);
+    case Reduction::None:
+      break;
+    }
+    llvm_unreachable("not a reduction");
+  }
+
+  // Combines one body value into a reduction. The fast-math flags are what
+  // the Reduction semantics allow, and what the vectorizer needs to keep
+  // several partial results and combine them at the end.
+  static Value *CreateReduction(Reduction R, Value *Acc, Value *V)
+  {
+    IRBuilder<>::FastMathFlagGuard Guard(*Builder);
+    FastMathFlags FMF;
+    switch (R)
+    {
+    case Reduction::Sum:
+      FMF.setAllowReassoc();
+      Builder->setFastMathFlags(FMF);
+      return Builder->CreateFAdd(Acc, V, "sum");
+    case Reduction::Product:
+      FMF.setAllowReassoc();
+      Builder->setFastMathFlags(FMF);
+      return Builder->CreateFMul(Acc, V, "product");
+    case Reduction::Min:
+    case Reduction::Max:
+    {
+      FMF.setNoNaNs();
+      FMF.setNoSignedZeros();
+      Builder->setFastMathFlags(FMF);
+      Value *Better = R == Reduction::Min ? Builder->CreateFCmpOLT(V, Acc)
+                                          : Builder->CreateFCmpOGT(V, Acc);
+      return Builder->CreateSelect(Better, V, Acc, R == Reduction::Min ? "min" : "max");
+    }
+    case Reduction::None:
+      break;
+    }
+    llvm_unreachable("not a reduction");
+  }
+
+  // For "i < X" with an integral i and a loop-invariant X, the i64 bound to
+  // compare i against instead, computed once before the loop. An integral X
+  // is the bound as is. Only a parallel for counts in i64 up to a double X
+  // (see IntegerTypes); i < X exactly when i < ceil(X), with X first
+  // clamped to +-ParallelBound, and a NaN X, which '<' treats as unordered
+  // and so as true, becoming the upper bound. Returns null when the end
+  // condition doesn't have that form.
+  Value *CodeGen::emitIntBound(ExprRef E, const ForExpr &N)
+  {
+    if (!Types.isIntBinding(E) || N.End.getKind() != ExprKind::Binary)
+      return nullptr;
+    auto &Cmp = T.get<BinaryExpr>(N.End);
+    if (Cmp.Op != '<' || Cmp.LHS.getKind() != ExprKind::Variable ||
+        T.get<VariableExpr>(Cmp.LHS).Name != N.VarName)
+      return nullptr;
+    bool IntX = Types.isInt(Cmp.RHS);
+
+    AssignmentFinder Finder(T);
+    Finder.Assigned.insert(N.VarName);
+    Finder.visit(N.Body);
+    if (N.Step)
+      Finder.visit(N.Step);
+    if (!IsLoopInvariant(T, Cmp.RHS, Finder.Assigned))
+      return nullptr;
+
+    Value *X = visit(Cmp.RHS);
+    if (!X || IntX)
+      return X;
+    X = toNum(X);
+    Constant *Lo = ConstantFP::get(getNumTy(), -(double)IntegerTypes::ParallelBound);
+    Constant *Hi = ConstantFP::get(getNumTy(), (double)IntegerTypes::ParallelBound);
+    X = Builder->CreateSelect(Builder->CreateFCmpOLT(X, Hi), X, Hi);
+    X = Builder->CreateSelect(Builder->CreateFCmpOGT(X, Lo), X, Lo);
+    X = Builder->CreateUnaryIntrinsic(Intrinsic::ceil, X);
+    return Builder->CreateFPToSI(X, Type::getInt64Ty(*TheContext), "bound");
+  }
+
+  // Array accesses in a loop body at the loop variable plus a constant,
+  // "a[i]" or "a[i + 1]", where the body neither assigns the variable nor
+  // declares another array of the same name. Over the whole loop their
+  // indices span a range that can be checked before it starts.
+  class IndexRangeFinder : public ExprVisitor<IndexRangeFinder>
+  {
+  private:
+    const IntegerTypes &Types;
+    Symbol Var;
+    const DenseSet<Symbol> &Assigned;
+
+    // Whether E is Var plus integer literals, adding them up in Offset.
+    bool addOffset(ExprRef E, int64_t &Offset) const
+    {
+      if (E.getKind() == ExprKind::Variable)
+        return T.get<VariableExpr>(E).Name == Var;
+      if (E.getKind() != ExprKind::Binary)
+        return false;
+      auto &N = T.get<BinaryExpr>(E);
+      if (N.Op == '+' && Types.isInt(N.LHS) && N.LHS.getKind() == ExprKind::Number)
+      {
+        Offset += (int64_t)T.get<NumberExpr>(N.LHS).Val;
+        return addOffset(N.RHS, Offset);
+      }
+      if ((N.Op == '+' || N.Op == '-') && Types.isInt(N.RHS) && N.RHS.getKind() == ExprKind::Number)
+      {
+        int64_t Literal = (int64_t)T.get<NumberExpr>(N.RHS).Val;
+        Offset += N.Op == '+' ? Literal : -Literal;
+        return addOffset(N.LHS, Offset);
+      }
+      return false;
+    }
+
+  public:
+    // The smallest and largest offset from the loop variable each array is
+    // accessed at.
+    MapVector<Symbol, std::pair<int64_t, int64_t>> Ranges;
+    // The IndexExpr nodes the ranges cover.
+    DenseSet<uint32_t> Nodes;
+
+    IndexRangeFinder(const Tree &T, const IntegerTypes &Types, Symbol Var,
+                     const DenseSet<Symbol> &Assigned)
+        : ExprVisitor(T), Types(Types), Var(Var), Assigned(Assigned) {}
+
+    void visitIndex(ExprRef E, const IndexExpr &N)
+    {
+      visitExpr(E);
+      int64_t Offset = 0;
+      AllocaInst *A = NamedValues.lookup(N.Array);
+      if (!A || !isArray(A) || Assigned.count(N.Array) || !addOffset(N.Index, Offset))
+        return;
+      auto Range = Ranges.insert({N.Array, {Offset, Offset}});
+      Range.first->second.first = std::min(Range.first->second.first, Offset);
+      Range.first->second.second = std::max(Range.first->second.second, Offset);
+      Nodes.insert(E.getRaw());
+    }
+  };
+
+  // Checks the accesses IndexRangeFinder collects before a loop whose
+  // variable runs from Start up to below Bound. Returns whether they are
+  // all in bounds, filling in Hoisted, or null if there is nothing to
+  // check. Only innermost loops qualify, as their body is emitted twice.
+  Value *CodeGen::emitHoistedChecks(const ForExpr &N, Value *Start, Value *Bound,
+                                    DenseSet<uint32_t> &Hoisted)
+  {
+    // Integral steps are literals; the variable has to grow.
+    if (!Bound || (N.Step && T.get<NumberExpr>(N.Step).Val < 1))
+      return nullptr;
+    LoopFinder Loops(T);
+    Loops.visit(N.Body);
+    if (Loops.Found)
+      return nullptr;
+    AssignmentFinder Assignments(T);
+    Assignments.visit(N.Body);
+    if (Assignments.Assigned.count(N.VarName))
+      return nullptr;
+    IndexRangeFinder Accesses(T, Types, N.VarName, Assignments.Assigned);
+    Accesses.visit(N.Body);
+    if (Accesses.Ranges.empty())
+      return nullptr;
+
+    // The first index is Start plus the smallest offset; the last is below
+    // Bound plus the largest.
+    Type *I64 = Type::getInt64Ty(*TheContext);
+    Value *InRange = Builder->getTrue();
+    for (const auto &Range : Accesses.Ranges)
+    {
+      AllocaInst *A = NamedValues.lookup(Range.first);
+      Value *Length = Builder->CreateExtractValue(
+          Builder->CreateLoad(getArrayTy(), A, Symbols.name(Range.first)), 1, "length");
+      Value *First = Builder->CreateICmpSGE(Start, ConstantInt::get(I64, -Range.second.first, true));
+      Value *Last = Builder->CreateICmpSLE(Bound, Builder->CreateSub(Length, ConstantInt::get(I64, Range.second.second, true)));
+      InRange = Builder->CreateAnd(InRange, Builder->CreateAnd(First, Last));
+    }
+    Hoisted = std::move(Accesses.Nodes);
+    // A loop that doesn't run accesses nothing.
+    return Builder->CreateOr(Builder->CreateICmpSGE(Start, Bound), InRange, "inrange");
+  }
+
+  // Emits a loop from its end condition on, continuing in AfterBB, which
+  // is created if null.
+  bool CodeGen::emitLoop(ExprRef E, const ForExpr &N, Value *Bound, Value *ArenaMark,
+                         BasicBlock *&AfterBB)
+  {
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    bool IsInt = Types.isIntBinding(E);
+    AllocaInst *AllocaRet = NamedValues.lookup(LastValueSym);
+    AllocaInst *Alloca = NamedValues.lookup(N.VarName);
+    // What the body declares is gone once the loop is, so a second copy
+    // of it starts from the same names.
+    NamedValues.enterScope();
+
+    BasicBlock *LoopBB =
+        BasicBlock::Create(*TheContext, "loop", TheFunction);
+    BasicBlock *LoopBodyBB =
+        BasicBlock::Create(*TheContext, "loopbody", TheFunction);
+    if (!AfterBB)
+      AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+
+    Builder->CreateBr(LoopBB);
+
+    Builder->SetInsertPoint(LoopBodyBB);
+    Value *BodyRet = visit(N.Body);
+    if (!BodyRet)
+    {
+      NamedValues.exitScope();
+      return false;
+    }
+    Value *RetVal = toNum(BodyRet);
+    if (N.Reduce != Reduction::None)
+    {
+      Value *Acc = Builder->CreateLoad(AllocaRet->getAllocatedType(), AllocaRet, "_");
+      RetVal = CreateReduction(N.Reduce, Acc, RetVal);
+    }
+    Builder->CreateStore(RetVal, AllocaRet);
+    Value *StepVal = nullptr;
+    if (N.Step)
+    {
+      StepVal = visit(N.Step);
+      if (!StepVal)
+      {
+        NamedValues.exitScope();
+        return false;
+      }
+    }
+    else if (IsInt)
+    {
+      StepVal = ConstantInt::get(Type::getInt64Ty(*TheContext), 1);
+    }
+    else
+    {
+      StepVal = ConstantFP::get(getNumTy(), 1.0);
+    }
+    Value *CurVar =
+        Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, Symbols.name(N.VarName));
+    // An integral counter stays within twice the number type's exact range
+    // (see IntegerTypes), far from 2^63, which lets the loop passes rely on
+    // it not wrapping.
+    Value *NextVar = IsInt ? Builder->CreateNSWAdd(CurVar, StepVal, "nextvar")
+                           : Builder->CreateFAdd(CurVar, toNum(StepVal), "nextvar");
+    Builder->CreateStore(NextVar, Alloca);
+    // Arrays declared in the loop last one iteration.
+    if (ArenaMark)
+      releaseArena(ArenaMark);
+    Builder->CreateBr(LoopBB);
+
+    Builder->SetInsertPoint(LoopBB);
+    Value *EndCond;
+    if (Bound)
+      EndCond = Builder->CreateICmpSLT(
+          Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, Symbols.name(N.VarName)),
+          Bound, "loopcond");
+    else
+    {
+      EndCond = visit(N.End);
+      if (!EndCond)
+      {
+        NamedValues.exitScope();
+        return false;
+      }
+      EndCond = isTrue(EndCond, "loopcond");
+    }
+    Builder->CreateCondBr(EndCond, LoopBodyBB, AfterBB);
+    NamedValues.exitScope();
+    return true;
+  }
+
+  // Emits the loop from Start, twice when the bounds checks in its body
+  // can be done up front: when every access is in bounds, a copy of the
+  // loop without their checks runs instead, which can be vectorized.
+  bool CodeGen::emitLoops(ExprRef E, const ForExpr &N, Value *Start, Value *Bound,
+                          Value *ArenaMark, BasicBlock *&AfterBB)
+  {
+    DenseSet<uint32_t> Hoisted;
+    Value *InRange = emitHoistedChecks(N, Start, Bound, Hoisted);
+    if (!InRange)
+      return emitLoop(E, N, Bound, ArenaMark, AfterBB);
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *UncheckedBB = BasicBlock::Create(*TheContext, "unchecked", TheFunction);
+    BasicBlock *CheckedBB = BasicBlock::Create(*TheContext, "checked", TheFunction);
+    Builder->CreateCondBr(InRange, UncheckedBB, CheckedBB);
+    Builder->SetInsertPoint(UncheckedBB);
+    std::swap(Unchecked, Hoisted);
+    bool Emitted = emitLoop(E, N, Bound, ArenaMark, AfterBB);
+    std::swap(Unchecked, Hoisted);
+    Builder->SetInsertPoint(CheckedBB);
+    return Emitted && emitLoop(E, N, Bound, ArenaMark, AfterBB);
+  }
+
+  // Toppings a parallel for body uses, which it gets copies of.
+  class CaptureFinder : public ExprVisitor<CaptureFinder>
+  {
+  public:
+    SetVector<Symbol> Names;
+
+    using ExprVisitor::ExprVisitor;
+
+    void visitVariable(ExprRef, const VariableExpr &N) { Names.insert(N.Name); }
+
+    void visitIndex(ExprRef E, const IndexExpr &N)
+    {
+      Names.insert(N.Array);
+      visitExpr(E);
+    }
+  };
+
+  // The first topping a parallel for body sets that it didn't declare
+  // itself, if any. Iterations running at the same time would race on it,
+  // and on the copies the body gets the result would be lost anyway. The
+  // loop variable counts: each chunk counts on its own.
+  class SharedAssignmentFinder : public ExprVisitor<SharedAssignmentFinder>
+  {
+  private:
+    ScopedSymbolTable<bool> Declared;
+
+  public:
+    Symbol Shared = NoSymbol;
+
+    using ExprVisitor::ExprVisitor;
+
+    void visitBinary(ExprRef E, const BinaryExpr &N)
+    {
+      if (N.Op == '=' && N.LHS.getKind() == ExprKind::Variable && Shared == NoSymbol)
+      {
+        Symbol Name = T.get<VariableExpr>(N.LHS).Name;
+        if (!Declared.lookup(Name))
+          Shared = Name;
+      }
+      visitExpr(E);
+    }
+
+    void visitFor(ExprRef, const ForExpr &N)
+    {
+      Declared.enterScope();
+      visit(N.Start);
+      Declared.bind(N.VarName, true);
+      visit(N.End);
+      if (N.Step)
+        visit(N.Step);
+      visit(N.Body);
+      Declared.exitScope();
+    }
+
+    void visitVar(ExprRef, const VarExpr &N)
+    {
+      for (const auto &VB : T.getBindings(N.Bindings))
+      {
+        if (VB.Init)
+          visit(VB.Init);
+        if (VB.Length)
+          visit(VB.Length);
+        Declared.bind(VB.Name, true);
+      }
+      if (N.Body)
+        visit(N.Body);
+    }
+
+    void visitScope(ExprRef E, const ScopeExpr &)
+    {
+      Declared.enterScope();
+      visitExpr(E);
+      Declared.exitScope();
+    }
+  };
+
+  // A parallel for moves its body into a function of its own, which runs
+  // the loop over a range of counter values. pizza_parallel_for splits the
+  // iterations into chunks and calls it on them from several threads; the
+  // result of each chunk, reduced or its last iteration's, is combined
+  // here in order, so the loop's value doesn't depend on which thread ran
+  // what. The iterations have to be known up front.
+  Value *CodeGen::emitParallelFor(ExprRef E, const ForExpr &N, Value *StartVal)
+  {
+    Value *Bound = emitIntBound(E, N);
+    if (!Bound || (N.Step && T.get<NumberExpr>(N.Step).Val < 1))
+      return LogErrorV("a parallel for needs an integer counter that grows up to a bound its body doesn't change");
+    SharedAssignmentFinder Assignments(T);
+    Assignments.visit(N.Body);
+    if (Assignments.Shared != NoSymbol)
+      return LogErrorV(("a parallel for body can only set toppings it declares, not '" +
+                        Symbols.name(Assignments.Shared) + "'; combine values with a reduction instead")
+                           .str()
+                           .c_str());
+
+    LLVMContext &C = *TheContext;
+    Type *I64 = Type::getInt64Ty(C);
+    Type *DoubleTy = Type::getDoubleTy(C);
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    CaptureFinder Uses(T);
+    Uses.visit(N.Body);
+    SmallVector<std::pair<Symbol, AllocaInst *>, 8> Captures;
+    SmallVector<Type *, 8> Fields;
+    for (Symbol Name : Uses.Names)
+    {
+      AllocaInst *A = Name == N.VarName ? nullptr : NamedValues.lookup(Name);
+      if (!A)
+        continue;
+      Captures.push_back({Name, A});
+      Fields.push_back(A->getAllocatedType());
+    }
+    StructType *CapturesTy = StructType::get(C, Fields);
+
+    FunctionType *BodyTy = FunctionType::get(DoubleTy, {Type::getInt8PtrTy(C), I64, I64}, false);
+    Function *Body = Function::Create(BodyTy, Function::ExternalLinkage,
+                                      TheFunction->getName() + "__parallel", TheModule.get());
+    ParallelBodies.push_back(Body);
+    if (!emitParallelBody(E, N, Body, CapturesTy, Captures))
+      return nullptr;
+
+    AllocaInst *Copies = CreateEntryBlockAlloca(TheFunction, CapturesTy, "captures");
+    for (unsigned I = 0; I < Captures.size(); I++)
+    {
+      AllocaInst *A = Captures[I].second;
+      Builder->CreateStore(Builder->CreateLoad(A->getAllocatedType(), A, Symbols.name(Captures[I].first)),
+                           Builder->CreateStructGEP(CapturesTy, Copies, I));
+    }
+    AllocaInst *Partials = CreateEntryBlockAlloca(
+        TheFunction, ArrayType::get(DoubleTy, MaxParallelChunks), "partials");
+    Value *Zero = ConstantInt::get(I64, 0);
+    FunctionCallee ParallelFor = TheModule->getOrInsertFunction(
+        "pizza_parallel_for", I64, BodyTy->getPointerTo(), Type::getInt8PtrTy(C), I64, I64, I64,
+        DoubleTy->getPointerTo());
+    Value *Step = ConstantInt::get(I64, N.Step ? (int64_t)T.get<NumberExpr>(N.Step).Val : 1);
+    Value *Chunks = Builder->CreateCall(
+        ParallelFor, {Body, Builder->CreateBitCast(Copies, Type::getInt8PtrTy(C)), StartVal, Bound, Step,
+                      Builder->CreateInBoundsGEP(Partials->getAllocatedType(), Partials, {Zero, Zero})},
+        "chunks");
+    Value *Empty = Builder->CreateICmpEQ(Chunks, Zero, "empty");
+
+    // Like a sequential loop, one that doesn't run evaluates to its start.
+    if (N.Reduce == Reduction::None)
+    {
+      Value *Last = Builder->CreateSelect(Empty, Zero, Builder->CreateSub(Chunks, ConstantInt::get(I64, 1)));
+      Value *Ptr = Builder->CreateInBoundsGEP(Partials->getAllocatedType(), Partials, {Zero, Last});
+      Value *LastVal = convertTo(Builder->CreateLoad(Type::getDoubleTy(C), Ptr, "partial"), getNumTy());
+      return Builder->CreateSelect(Empty, toNum(StartVal), LastVal, "_");
+    }
+
+    BasicBlock *EntryBB = Builder->GetInsertBlock();
+    BasicBlock *CombineBB = BasicBlock::Create(C, "combine", TheFunction);
+    BasicBlock *CombinedBB = BasicBlock::Create(C, "combined", TheFunction);
+    Value *Identity = GetReductionIdentity(N.Reduce);
+    Builder->CreateCondBr(Empty, CombinedBB, CombineBB);
+
+    Builder->SetInsertPoint(CombineBB);
+    PHINode *Chunk = Builder->CreatePHI(I64, 2, "chunk");
+    PHINode *Acc = Builder->CreatePHI(getNumTy(), 2, "_");
+    Value *Ptr = Builder->CreateInBoundsGEP(Partials->getAllocatedType(), Partials, {Zero, Chunk});
+    Value *Partial = convertTo(Builder->CreateLoad(Type::getDoubleTy(C), Ptr, "partial"), getNumTy());
+    Value *NextAcc = CreateReduction(N.Reduce, Acc, Partial);
+    Value *NextChunk = Builder->CreateNUWAdd(Chunk, ConstantInt::get(I64, 1), "nextchunk");
+    Chunk->addIncoming(Zero, EntryBB);
+    Chunk->addIncoming(NextChunk, CombineBB);
+    Acc->addIncoming(Identity, EntryBB);
+    Acc->addIncoming(NextAcc, CombineBB);
+    Builder->CreateCondBr(Builder->CreateICmpULT(NextChunk, Chunks), CombineBB, CombinedBB);
+
+    Builder->SetInsertPoint(CombinedBB);
+    PHINode *Result = Builder->CreatePHI(getNumTy(), 2, "_");
+    Result->addIncoming(Identity, EntryBB);
+    Result->addIncoming(NextAcc, CombineBB);
+    return Result;
+  }
+
+  // Fills in a parallel for's Body: the loop from its second argument up
+  // to below its third, over copies of the toppings in its first.
+  bool CodeGen::emitParallelBody(ExprRef E, const ForExpr &N, Function *Body, StructType *CapturesTy,
+                                 ArrayRef<std::pair<Symbol, AllocaInst *>> Captures)
+  {
+    IRBuilderBase::InsertPointGuard Guard(*Builder);
+    auto Arg = Body->arg_begin();
+    Argument *Copies = &*Arg++;
+    Argument *Lo = &*Arg++;
+    Argument *Hi = &*Arg;
+    Copies->setName("captures");
+    Lo->setName("lo");
+    Hi->setName("hi");
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Body));
+
+    // Everything the body uses from outside is bound to a copy here.
+    NamedValues.enterScope();
+    Value *CopiesPtr = Builder->CreateBitCast(Copies, CapturesTy->getPointerTo());
+    for (unsigned I = 0; I < Captures.size(); I++)
+    {
+      Symbol Name = Captures[I].first;
+      AllocaInst *Outer = Captures[I].second;
+      AllocaInst *Alloca = isArray(Outer)
+                               ? CreateArrayAlloca(Body, Name)
+                               : CreateEntryBlockAlloca(Body, Name, Outer->getAllocatedType()->isIntegerTy());
+      Value *Ptr = Builder->CreateStructGEP(CapturesTy, CopiesPtr, I);
+      Builder->CreateStore(Builder->CreateLoad(Alloca->getAllocatedType(), Ptr, Symbols.name(Name)), Alloca);
+      NamedValues.bind(Name, Alloca);
+    }
+
+    // A chunk is never empty, so without a reduction the loop value is
+    // always some iteration's.
+    AllocaInst *AllocaRet = CreateEntryBlockAlloca(Body, LastValueSym);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(Body, N.VarName, /*IsInt=*/true);
+    Builder->CreateStore(N.Reduce == Reduction::None ? ConstantFP::get(getNumTy(), 0.0)
+                                                     : GetReductionIdentity(N.Reduce),
+                         AllocaRet);
+    Builder->CreateStore(Lo, Alloca);
+    NamedValues.bind(LastValueSym, AllocaRet);
+    NamedValues.bind(N.VarName, Alloca);
+
+    // The body waits for its own spawns before returning.
+    AllocaInst *OuterGroup = Group;
+    Group = HasSpawns(T, N.Body) ? CreateTaskGroup(Body) : nullptr;
+    Value *ArenaMark = DeclaresArrays(T, N.Body) ? EmitArenaMark() : nullptr;
+    BasicBlock *AfterBB = nullptr;
+    bool Emitted = emitLoops(E, N, Lo, Hi, ArenaMark, AfterBB);
+    if (Emitted)
+    {
+      Builder->SetInsertPoint(AfterBB);
+      if (Group)
+        EmitSync(Group);
+      if (ArenaMark)
+        EmitArenaRelease(ArenaMark);
+      Value *Result = Builder->CreateLoad(AllocaRet->getAllocatedType(), AllocaRet, "_");
+      Builder->CreateRet(convertTo(Result, Type::getDoubleTy(*TheContext)));
+    }
+    Group = OuterGroup;
+    NamedValues.exitScope();
+    return Emitted;
+  }
+
+  Value *CodeGen::visitFor(ExprRef E, const ForExpr &N)
+  {
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    NamedValues.enterScope();
+
+    Value *StartVal = visit(N.Start);
+    if (!StartVal)
+    {
+      NamedValues.exitScope();
+      return nullptr;
+    }
+    if (N.Parallel)
+    {
+      Value *Result = emitParallelFor(E, N, StartVal);
+      NamedValues.exitScope();
+      return Result;
+    }
+
+    // The loop value "_" is always a double; the variable is an i64 if it
+    // only counts in integer steps.
+    // With a reduction, the loop value is the result so far.
+    bool IsInt = Types.isIntBinding(E);
+    AllocaInst *AllocaRet = CreateEntryBlockAlloca(TheFunction, LastValueSym);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, N.VarName, IsInt);
+    Builder->CreateStore(N.Reduce == Reduction::None ? toNum(StartVal) : GetReductionIdentity(N.Reduce),
+                         AllocaRet);
+    Builder->CreateStore(IsInt ? StartVal : toNum(StartVal), Alloca);
+    NamedValues.bind(LastValueSym, AllocaRet);
+    NamedValues.bind(N.VarName, Alloca);
+
+    Value *Bound = emitIntBound(E, N);
+    Value *ArenaMark = DeclaresArrays(T, E) ? EmitArenaMark() : nullptr;
+
+    BasicBlock *AfterBB = nullptr;
+    if (!emitLoops(E, N, StartVal, Bound, ArenaMark, AfterBB))
+    {
+      NamedValues.exitScope();
+      return nullptr;
+    }
+
+    Builder->SetInsertPoint(AfterBB);
+    if (ArenaMark)
+      releaseArena(ArenaMark);
+    Value *lastStatement =
+        Builder->CreateLoad(AllocaRet->getAllocatedType(), AllocaRet, "_");
+    NamedValues.exitScope();
+    return lastStatement;
+  }
+
+  Value *CodeGen::visitUnary(ExprRef, const UnaryExpr &N)
+  {
+    Value *OperandV = visit(N.Operand);
+    if (!OperandV)
+      return nullptr;
+
+    Function *F = getFunction(getOperatorSymbol(false, N.Opcode));
+    if (!F)
+    {
+      using namespace std::string_literals;
+      return LogErrorV(("Unknown unary operator "s + N.Opcode).c_str());
+    }
+
+    return CreateNumCall(F, OperandV, "unop");
+  }
+
+  Value *CodeGen::visitScope(ExprRef E, const ScopeExpr &N)
+  {
+    NamedValues.enterScope();
+    Value *ArenaMark = DeclaresArrays(T, E) ? EmitArenaMark() : nullptr;
+    Value *last;
+    bool anyEmpty = false;
+    for (ExprRef e : T.getList(N.Body))
+    {
+      Value *V = visit(e);
+      if (!V)
+      {
+        anyEmpty = true;
+      }
+      last = V;
+    }
+    NamedValues.exitScope();
+    if (anyEmpty)
+    {
+      return nullptr;
+    }
+    if (ArenaMark)
+      releaseArena(ArenaMark);
+    return last;
+  }
+
+  // Top-level expressions that only compute a number are evaluated by
+  // walking their tree, which is far quicker than optimizing, JIT-compiling
+  // and linking a module to run once. Evaluation gives up, leaving the
+  // expression to the JIT, at anything it can't do exactly as compiled code
+  // would: calls to sauces other than the math ones, parallel fors, out of
+  // bounds accesses, and more than ConstEvalSteps nodes visited or array
+  // elements zeroed.
+  static const uint64_t ConstEvalSteps = 1 << 16;
+  // Nesting of calls, which the evaluator makes on the compiler's stack.
+  static const unsigned ConstEvalDepth = 256;
+
+  // A pure base as the evaluator runs it: a copy of its body, which
+  // outlives the tree it was parsed into, and what codegen worked out
+  // about that body.
+  struct ConstBase
+  {
+    std::vector<Symbol> Params;
+    ExprRef Body;
+    IntegerTypes Types;
+    TailRecursion Tail;
+  };
+  static Tree ConstTree;
+  static DenseMap<Symbol, std::unique_ptr<ConstBase>> ConstBases;
+
+  static bool IsConstBase(Symbol Name) { return ConstBases.count(Name); }
+
+  // Copies E and its children from one tree into another.
+  static ExprRef CopyExpr(const Tree &From, ExprRef E, Tree &To)
+  {
+    if (!E)
+      return E;
+    switch (E.getKind())
+    {
+    case ExprKind::Number:
+      return To.add(From.get<NumberExpr>(E));
+    case ExprKind::Variable:
+      return To.add(From.get<VariableExpr>(E));
+    case ExprKind::Binary:
+    {
+      auto N = From.get<BinaryExpr>(E);
+      N.LHS = CopyExpr(From, N.LHS, To);
+      N.RHS = CopyExpr(From, N.RHS, To);
+      return To.add(N);
+    }
+    case ExprKind::Unary:
+    {
+      auto N = From.get<UnaryExpr>(E);
+      N.Operand = CopyExpr(From, N.Operand, To);
+      return To.add(N);
+    }
+    case ExprKind::Call:
+    {
+      auto N = From.get<CallExpr>(E);
+      SmallVector<ExprRef, 4> Args;
+      for (ExprRef Arg : From.getList(N.Args))
+        Args.push_back(CopyExpr(From, Arg, To));
+      N.Args = To.addList(Args);
+      return To.add(N);
+    }
+    case ExprKind::If:
+    {
+      auto N = From.get<IfExpr>(E);
+      N.Cond = CopyExpr(From, N.Cond, To);
+      N.Then = CopyExpr(From, N.Then, To);
+      N.Else = CopyExpr(From, N.Else, To);
+      return To.add(N);
+    }
+    case ExprKind::For:
+    {
+      auto N = From.get<ForExpr>(E);
+      N.Start = CopyExpr(From, N.Start, To);
+      N.End = CopyExpr(From, N.End, To);
+      N.Step = CopyExpr(From, N.Step, To);
+      N.Body = CopyExpr(From, N.Body, To);
+      return To.add(N);
+    }
+    case ExprKind::Var:
+    {
+      auto N = From.get<VarExpr>(E);
+      SmallVector<VarBinding, 4> Bindings;
+      for (VarBinding B : From.getBindings(N.Bindings))
+      {
+        B.Init = CopyExpr(From, B.Init, To);
+        B.Length = CopyExpr(From, B.Length, To);
+        Bindings.push_back(B);
+      }
+      N.Bindings = To.addBindings(Bindings);
+      N.Body = CopyExpr(From, N.Body, To);
+      return To.add(N);
+    }
+    case ExprKind::Scope:
+    {
+      auto N = From.get<ScopeExpr>(E);
+      SmallVector<ExprRef, 8> Body;
+      for (ExprRef Child : From.getList(N.Body))
+        Body.push_back(CopyExpr(From, Child, To));
+      N.Body = To.addList(Body);
+      return To.add(N);
+    }
+    case ExprKind::Index:
+    {
+      auto N = From.get<IndexExpr>(E);
+      N.Index = CopyExpr(From, N.Index, To);
+      return To.add(N);
+    }
+    case ExprKind::Spawn:
+    {
+      auto N = From.get<SpawnExpr>(E);
+      N.Call = CopyExpr(From, N.Call, To);
+      return To.add(N);
+    }
+    case ExprKind::Sync:
+      return To.add(From.get<SyncExpr>(E));
+    }
+    llvm_unreachable("unknown expression kind");
+  }
+
+  // Keeps a base for the evaluator if it is pure: it may only call itself,
+  // other bases the evaluator has and math sauces.
+  static void AddConstBase(const Tree &T, Symbol Name, ExprRef Body)
+  {
+    PurityChecker Checker(T, Name, IsConstBase);
+    Checker.visit(Body);
+    if (!Checker.Pure)
+      return;
+
+    auto B = std::make_unique<ConstBase>();
+    B->Params = FunctionProtos[Name]->getArgs();
+    B->Body = CopyExpr(T, Body, ConstTree);
+    // As in FunctionAST::codegen, memoized bases don't accumulate.
+    bool Memoized = any_of(MemoTables, [&](const auto &Entry)
+                           { return Entry.first == Name; });
+    TailCallFinder(ConstTree, Name, B->Params.size(), !Memoized, B->Tail).visit(B->Body);
+    B->Types.run(ConstTree, B->Params, B->Body, getMaxExact());
+    ConstBases[Name] = std::move(B);
+  }
+
+  // Rounds a number the way storing it in the program's number type does.
+  static double roundToNum(double V)
+  {
+    return singlePrecision ? (double)(float)V : V;
+  }
+
+  // Evaluates a math sauce as the JIT's code would. Under --precision=f32
+  // that is sinf and the like, which needn't round the way sin does, so
+  // only the sauces whose results are exact in either precision are
+  // evaluated there. Which of two zeros minnum and maxnum return is up to
+  // the target.
+  static Optional<double> EvaluateMath(Intrinsic::ID IID, ArrayRef<double> Args)
+  {
+    switch (IID)
+    {
+    case Intrinsic::sqrt:
+      return roundToNum(std::sqrt(Args[0]));
+    case Intrinsic::fabs:
+      return std::fabs(Args[0]);
+    case Intrinsic::floor:
+      return std::floor(Args[0]);
+    case Intrinsic::ceil:
+      return std::ceil(Args[0]);
+    case Intrinsic::trunc:
+      return std::trunc(Args[0]);
+    case Intrinsic::round:
+      return std::round(Args[0]);
+    case Intrinsic::rint:
+      return std::rint(Args[0]);
+    case Intrinsic::nearbyint:
+      return std::nearbyint(Args[0]);
+    case Intrinsic::copysign:
+      return std::copysign(Args[0], Args[1]);
+    case Intrinsic::minnum:
+    case Intrinsic::maxnum:
+      if (Args[0] == 0 && Args[1] == 0 && std::signbit(Args[0]) != std::signbit(Args[1]))
+        return None;
+      return IID == Intrinsic::minnum ? std::fmin(Args[0], Args[1]) : std::fmax(Args[0], Args[1]);
+    default:
+      break;
+    }
+    if (singlePrecision)
+      return None;
+    switch (IID)
+    {
+    case Intrinsic::sin:
+      return std::sin(Args[0]);
+    case Intrinsic::cos:
+      return std::cos(Args[0]);
+    case Intrinsic::exp:
+      return std::exp(Args[0]);
+    case Intrinsic::exp2:
+      return std::exp2(Args[0]);
+    case Intrinsic::log:
+      return std::log(Args[0]);
+    case Intrinsic::log2:
+      return std::log2(Args[0]);
+    case Intrinsic::log10:
+      return std::log10(Args[0]);
+    case Intrinsic::pow:
+      return std::pow(Args[0], Args[1]);
+    case Intrinsic::fma:
+      return std::fma(Args[0], Args[1], Args[2]);
+    default:
+      return None;
+    }
+  }
+
+  // What the evaluators of one top-level expression have left to spend.
+  struct ConstBudget
+  {
+    uint64_t Steps = ConstEvalSteps;
+    unsigned Depth = 0;
+  };
+
+  // One call of a base. Its tail calls end the evaluation of the body with
+  // Jumped set and the new arguments in Args, and the body starts over, as
+  // the compiled base jumps back to its top.
+  struct ConstFrame
+  {
+    const TailRecursion &Tail;
+    std::vector<double> Args;
+    double Acc;
+    bool Jumped;
+  };
+
+  // Evaluates one body, or one run of it for a base, computing every
+  // number in the type codegen gives it: integral expressions exactly,
+  // everything else rounded to the program's precision. Returns None to
+  // leave the expression to the JIT.
+  class ConstEvaluator : public ExprVisitor<ConstEvaluator, Optional<double>>
+  {
+  private:
+    struct Slot
+    {
+      double Val;
+      bool Int;
+      bool Array;
+      std::vector<double> Elements;
+    };
+
+    const IntegerTypes &Types;
+    ConstBudget &Budget;
+    // Null for a top-level expression.
+    ConstFrame *Frame;
+    std::deque<Slot> Slots;
+    ScopedSymbolTable<Slot *> Names;
+
+    Slot *bind(Symbol Name, double Val, bool Int)
+    {
+      Slots.push_back({Val, Int, false, {}});
+      Names.bind(Name, &Slots.back());
+      return &Slots.back();
+    }
+
+    // NaNs are left to compiled code: the host makes them with another sign
+    // than LLVM's constant folder does, and print shows the sign.
+    static Optional<double> notNaN(Optional<double> V)
+    {
+      if (V && std::isnan(*V))
+        return None;
+      return V;
+    }
+
+    Optional<double> num(ExprRef E, Optional<double> V) const
+    {
+      if (!V || Types.isInt(E))
+        return V;
+      return roundToNum(*V);
+    }
+
+    bool evalArgs(const CallExpr &N, std::vector<double> &Args)
+    {
+      for (ExprRef Arg : T.getList(N.Args))
+      {
+        Optional<double> V = eval(Arg);
+        if (!V)
+          return false;
+        Args.push_back(roundToNum(*V));
+      }
+      return true;
+    }
+
+    // An array length or index as toCount converts it, -1 if invalid.
+    static int64_t toCount(double V)
+    {
+      return V > -1.0 && V < 0x1p62 ? (int64_t)V : -1;
+    }
+
+    Slot *element(const IndexExpr &N, int64_t &Index)
+    {
+      Slot *A = Names.lookup(N.Array);
+      if (!A || !A->Array)
+        return nullptr;
+      Optional<double> V = eval(N.Index);
+      if (!V)
+        return nullptr;
+      Index = toCount(*V);
+      if (Index < 0 || (uint64_t)Index >= A->Elements.size())
+        return nullptr;
+      return A;
+    }
+
+    Optional<double> jump(std::vector<double> Args)
+    {
+      Frame->Args = std::move(Args);
+      Frame->Jumped = true;
+      return 0.0;
+    }
+
+    Optional<double> call(Symbol Callee, ArrayRef<double> Args);
+    Optional<double> spawn(const SpawnExpr &N);
+    bool iterate(const ForExpr &N, Slot &Ret, Slot &Var);
+
+  public:
+    ConstEvaluator(const Tree &T, const IntegerTypes &Types, ConstBudget &Budget, ConstFrame *Frame)
+        : ExprVisitor(T), Types(Types), Budget(Budget), Frame(Frame) {}
+
+    Optional<double> eval(ExprRef E)
+    {
+      if (!Budget.Steps)
+        return None;
+      Budget.Steps--;
+      return visit(E);
+    }
+
+    // Evaluates a body with Params bound to Args, the first of a repeated
+    // name winning.
+    Optional<double> run(ArrayRef<Symbol> Params, ArrayRef<double> Args, ExprRef Body)
+    {
+      Names.enterScope();
+      for (size_t i = 0, e = Params.size(); i != e; ++i)
+        if (!Names.lookup(Params[i]))
+          bind(Params[i], Args[i], false);
+      Optional<double> V = eval(Body);
+      Names.exitScope();
+      return V;
+    }
+
+    Optional<double> visitNumber(ExprRef E, const NumberExpr &N)
+    {
+      if (Types.isInt(E))
+        return (double)(int64_t)N.Val;
+      return roundToNum(N.Val);
+    }
+
+    Optional<double> visitVariable(ExprRef, const VariableExpr &N)
+    {
+      Slot *S = Names.lookup(N.Name);
+      if (!S)
+        return None;
+      return S->Array ? (double)S->Elements.size() : S->Val;
+    }
+
+    Optional<double> visitIndex(ExprRef, const IndexExpr &N)
+    {
+      int64_t Index;
+      Slot *A = element(N, Index);
+      if (!A)
+        return None;
+      return A->Elements[Index];
+    }
+
+    Optional<double> visitBinary(ExprRef E, const BinaryExpr &N);
+    Optional<double> visitUnary(ExprRef, const UnaryExpr &N);
+    Optional<double> visitCall(ExprRef E, const CallExpr &N);
+    Optional<double> visitFor(ExprRef E, const ForExpr &N);
+    Optional<double> visitVar(ExprRef E, const VarExpr &N);
 
-    StoreNamedValues();
+    Optional<double> visitIf(ExprRef E, const IfExpr &N)
+    {
+      Optional<double> Cond = eval(N.Cond);
+      if (!Cond)
+        return None;
+      // Not equal to zero, and not NaN.
+      return num(E, eval(*Cond < 0 || *Cond > 0 ? N.Then : N.Else));
+    }
 
-    Value *StartVal = Start->codegen();
-    if (!StartVal)
+    Optional<double> visitScope(ExprRef, const ScopeExpr &N)
     {
-      RestoreNamedValues();
-      return nullptr;
+      auto Body = T.getList(N.Body);
+      if (Body.empty())
+        return None;
+      Names.enterScope();
+      Optional<double> Last;
+      for (ExprRef Child : Body)
+        if (!(Last = eval(Child)))
+          break;
+      Names.exitScope();
+      return Last;
     }
 
-    AllocaInst *AllocaRet = CreateEntryBlockAlloca(TheFunction, "_");
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    Builder->CreateStore(StartVal, AllocaRet);
-    Builder->CreateStore(StartVal, Alloca);
-    NamedValues["_"] = std::move(AllocaRet);
-    NamedValues[VarName] = std::move(Alloca);
+    // Only as the value of a topping or an assignment.
+    Optional<double> visitSpawn(ExprRef, const SpawnExpr &) { return None; }
 
-    BasicBlock *LoopBB =
-        BasicBlock::Create(*TheContext, "loop", TheFunction);
-    BasicBlock *LoopBodyBB =
-        BasicBlock::Create(*TheContext, "loopbody", TheFunction);
-    BasicBlock *AfterBB =
-        BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    // Spawned calls are evaluated as plain ones, so there is nothing to wait for.
+    Optional<double> visitSync(ExprRef, const SyncExpr &) { return 0.0; }
+  };
 
-    Builder->CreateBr(LoopBB);
+  Optional<double> ConstEvaluator::call(Symbol Callee, ArrayRef<double> Args)
+  {
+    auto It = ConstBases.find(Callee);
+    if (It == ConstBases.end() || It->second->Params.size() != Args.size() ||
+        Budget.Depth == ConstEvalDepth)
+      return None;
+    const ConstBase &B = *It->second;
+
+    ConstFrame F{B.Tail, Args.vec(), B.Tail.AccOp == '*' ? 1.0 : 0.0, false};
+    Optional<double> Result;
+    Budget.Depth++;
+    do
+    {
+      F.Jumped = false;
+      Result = ConstEvaluator(ConstTree, B.Types, Budget, &F).run(B.Params, F.Args, B.Body);
+    } while (Result && F.Jumped);
+    Budget.Depth--;
+    if (!Result)
+      return None;
+
+    double V = roundToNum(*Result);
+    if (B.Tail.AccOp)
+      V = roundToNum(B.Tail.AccOp == '+' ? F.Acc + V : F.Acc * V);
+    return V;
+  }
 
-    Builder->SetInsertPoint(LoopBodyBB);
-    Value *BodyRet = Body->codegen();
-    if (!BodyRet)
+  Optional<double> ConstEvaluator::spawn(const SpawnExpr &N)
+  {
+    if (N.Call.getKind() != ExprKind::Call)
+      return None;
+    return eval(N.Call);
+  }
+
+  Optional<double> ConstEvaluator::visitBinary(ExprRef E, const BinaryExpr &N)
+  {
+    char Op = N.Op;
+    if (Op == '=')
     {
-      RestoreNamedValues();
-      return nullptr;
+      bool Spawned = N.RHS.getKind() == ExprKind::Spawn;
+      Optional<double> Val = Spawned ? spawn(T.get<SpawnExpr>(N.RHS)) : eval(N.RHS);
+      if (!Val)
+        return None;
+      if (N.LHS.getKind() == ExprKind::Index)
+      {
+        int64_t Index;
+        Slot *A = element(T.get<IndexExpr>(N.LHS), Index);
+        if (!A)
+          return None;
+        A->Elements[Index] = roundToNum(*Val);
+        return Spawned ? 0.0 : A->Elements[Index];
+      }
+      if (N.LHS.getKind() != ExprKind::Variable)
+        return None;
+      Slot *S = Names.lookup(T.get<VariableExpr>(N.LHS).Name);
+      if (!S || S->Array)
+        return None;
+      S->Val = S->Int ? *Val : roundToNum(*Val);
+      return Spawned ? 0.0 : S->Val;
     }
-    Builder->CreateStore(BodyRet, AllocaRet);
-    Value *StepVal = nullptr;
-    if (Step)
+
+    if (Frame)
     {
-      StepVal = Step->codegen();
-      if (!StepVal)
+      auto Acc = Frame->Tail.Accumulated.find(E.getRaw());
+      if (Acc != Frame->Tail.Accumulated.end())
       {
-        RestoreNamedValues();
-        return nullptr;
+        // The operands in the order emitAccumulate evaluates them.
+        bool CallOnLHS = Acc->second;
+        std::vector<double> Args;
+        if (CallOnLHS && !evalArgs(T.get<CallExpr>(N.LHS), Args))
+          return None;
+        Optional<double> V = eval(CallOnLHS ? N.RHS : N.LHS);
+        if (!V)
+          return None;
+        if (!CallOnLHS && !evalArgs(T.get<CallExpr>(N.RHS), Args))
+          return None;
+        double W = roundToNum(*V);
+        Frame->Acc = roundToNum(Frame->Tail.AccOp == '+' ? Frame->Acc + W : Frame->Acc * W);
+        if (std::isnan(Frame->Acc))
+          return None;
+        return jump(std::move(Args));
       }
     }
-    else
+
+    Optional<double> L = eval(N.LHS);
+    if (!L)
+      return None;
+    Optional<double> R = eval(N.RHS);
+    if (!R)
+      return None;
+
+    if (Types.isInt(E))
     {
-      StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+      switch (Op)
+      {
+      case '+':
+        return *L + *R;
+      case '-':
+        return *L - *R;
+      case '<':
+        return *L < *R ? 1.0 : 0.0;
+      default:
+        llvm_unreachable("only +, - and < have integral results");
+      }
     }
-    Value *CurVar =
-        Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
-    Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
-    Builder->CreateStore(NextVar, Alloca);
-    Builder->CreateBr(LoopBB);
 
-    Builder->SetInsertPoint(LoopBB);
-    Value *EndCond = End->codegen();
-    if (!EndCond)
+    double A = roundToNum(*L), B = roundToNum(*R);
+    switch (Op)
     {
-      RestoreNamedValues();
-      return nullptr;
+    case '+':
+      return notNaN(roundToNum(A + B));
+    case '-':
+      return notNaN(roundToNum(A - B));
+    case '*':
+      return notNaN(roundToNum(A * B));
+    case '/':
+      return notNaN(roundToNum(A / B));
+    case '<':
+      // Unordered or less than, as FCmpULT.
+      return !(A >= B) ? 1.0 : 0.0;
+    default:
+      break;
     }
-    EndCond = Builder->CreateFCmpONE(
-        EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
-    Builder->CreateCondBr(EndCond, LoopBodyBB, AfterBB);
 
-    Builder->SetInsertPoint(AfterBB);
-    Value *lastStatement =
-        Builder->CreateLoad(Alloca->getAllocatedType(), AllocaRet, "_");
-    RestoreNamedValues();
-    return lastStatement;
+    double Ops[2] = {A, B};
+    return call(getOperatorSymbol(true, Op), Ops);
   }
 
-  Value *UnaryExprAST::codegen()
+  Optional<double> ConstEvaluator::visitUnary(ExprRef, const UnaryExpr &N)
   {
-    Value *OperandV = Operand->codegen();
-    if (!OperandV)
-      return nullptr;
+    Optional<double> V = eval(N.Operand);
+    if (!V)
+      return None;
+    return call(getOperatorSymbol(false, N.Opcode), roundToNum(*V));
+  }
 
-    Function *F = getFunction(std::string("unary") + Opcode);
-    if (!F)
+  Optional<double> ConstEvaluator::visitCall(ExprRef E, const CallExpr &N)
+  {
+    std::vector<double> Args;
+    if (!evalArgs(N, Args))
+      return None;
+    if (Frame && Frame->Tail.Calls.count(E.getRaw()))
+      return jump(std::move(Args));
+
+    // Bases compiled before a math sauce was redefined still call libm.
+    if (MathSauces.count(N.Callee) && DefinedBases.count(N.Callee))
+      return None;
+    Intrinsic::ID IID = GetMathIntrinsic(N.Callee, Args.size());
+    if (IID != Intrinsic::not_intrinsic)
+      return notNaN(EvaluateMath(IID, Args));
+    return call(N.Callee, Args);
+  }
+
+  Optional<double> ConstEvaluator::visitVar(ExprRef E, const VarExpr &N)
+  {
+    double LastInitVal = 0.0;
+    unsigned Index = 0;
+    for (const auto &Binding : T.getBindings(N.Bindings))
     {
-      using namespace std::string_literals;
-      return LogErrorV(("Unknown unary operator "s + Opcode).c_str());
+      bool IsInt = Types.isIntBinding(E, Index++);
+      if (Binding.Length)
+      {
+        Optional<double> Length = eval(Binding.Length);
+        if (!Length)
+          return None;
+        // Zeroing the elements is work like any other.
+        int64_t Count = toCount(*Length);
+        if (Count < 0 || (uint64_t)Count > Budget.Steps)
+          return None;
+        Budget.Steps -= Count;
+        Slot *A = bind(Binding.Name, 0.0, false);
+        A->Array = true;
+        A->Elements.assign(Count, 0.0);
+        LastInitVal = roundToNum((double)Count);
+        continue;
+      }
+
+      double InitVal = 0.0;
+      if (Binding.Init && Binding.Init.getKind() == ExprKind::Spawn)
+      {
+        // Bound after the call, which can't see the topping it goes to.
+        Optional<double> V = spawn(T.get<SpawnExpr>(Binding.Init));
+        if (!V)
+          return None;
+        bind(Binding.Name, roundToNum(*V), false);
+        LastInitVal = 0.0;
+        continue;
+      }
+      if (Binding.Init)
+      {
+        Optional<double> V = eval(Binding.Init);
+        if (!V)
+          return None;
+        InitVal = IsInt ? *V : roundToNum(*V);
+      }
+      bind(Binding.Name, InitVal, IsInt);
+      LastInitVal = InitVal;
     }
 
-    return Builder->CreateCall(F, OperandV, "unop");
+    if (N.Body)
+      return eval(N.Body);
+    return LastInitVal;
   }
 
-  Value *ScopeExprAST::codegen()
+  bool ConstEvaluator::iterate(const ForExpr &N, Slot &Ret, Slot &Var)
   {
-    StoreNamedValues();
-    Value *last;
-    bool anyEmpty = false;
-    std::for_each(Body.begin(), Body.end(), [&last, &anyEmpty](const auto &e) {
-      Value *V = e->codegen();
-      if (!V)
+    // Sum and product are only evaluated when every order of combining the
+    // values gives the same result: they are integers, and the sum or
+    // product of their magnitudes is exact.
+    double Exact = getMaxExact();
+    double Magnitude = N.Reduce == Reduction::Product ? 1.0 : 0.0;
+    while (1)
+    {
+      Optional<double> Cond = eval(N.End);
+      if (!Cond)
+        return false;
+      if (!(*Cond < 0 || *Cond > 0))
+        return true;
+
+      Optional<double> Body = eval(N.Body);
+      if (!Body)
+        return false;
+      double V = roundToNum(*Body);
+      switch (N.Reduce)
       {
-        anyEmpty = true;
+      case Reduction::None:
+        Ret.Val = V;
+        break;
+      case Reduction::Sum:
+      case Reduction::Product:
+        if (V != std::trunc(V))
+          return false;
+        if (N.Reduce == Reduction::Sum)
+          Magnitude += std::fabs(V);
+        else if (V != 0)
+          Magnitude *= std::fabs(V);
+        if (Magnitude > Exact)
+          return false;
+        Ret.Val = N.Reduce == Reduction::Sum ? Ret.Val + V : Ret.Val * V;
+        break;
+      case Reduction::Min:
+      case Reduction::Max:
+        if (std::isnan(V) || (V == 0 && Ret.Val == 0 && std::signbit(V) != std::signbit(Ret.Val)))
+          return false;
+        if (N.Reduce == Reduction::Min ? V < Ret.Val : V > Ret.Val)
+          Ret.Val = V;
+        break;
       }
-      last = V;
-    });
-    RestoreNamedValues();
-    if (anyEmpty)
+
+      double Step = 1.0;
+      if (N.Step)
+      {
+        Optional<double> S = eval(N.Step);
+        if (!S)
+          return false;
+        Step = *S;
+      }
+      Var.Val = Var.Int ? Var.Val + Step : roundToNum(Var.Val + roundToNum(Step));
+    }
+  }
+
+  Optional<double> ConstEvaluator::visitFor(ExprRef E, const ForExpr &N)
+  {
+    if (N.Parallel)
+      return None;
+
+    Names.enterScope();
+    Optional<double> Start = eval(N.Start);
+    Optional<double> Result;
+    if (Start)
     {
-      return nullptr;
+      bool IsInt = Types.isIntBinding(E);
+      // In the order of Reduction.
+      double Identity[] = {roundToNum(*Start), 0.0, 1.0, INFINITY, -INFINITY};
+      Slot *Ret = bind(LastValueSym, Identity[(int)N.Reduce], false);
+      Slot *Var = bind(N.VarName, IsInt ? *Start : roundToNum(*Start), IsInt);
+      // What the body declares stays visible to the step and the end
+      // condition, as in emitLoop.
+      Names.enterScope();
+      if (iterate(N, *Ret, *Var))
+        Result = Ret->Val;
+      Names.exitScope();
     }
-    return last;
+    Names.exitScope();
+    return Result;
+  }
+
+  // Evaluates a top-level expression at compile time if it is pure and
+  // small enough; see ConstEvalSteps.
+  static Optional<double> EvaluateTopLevelExpression(const Tree &T, ExprRef Body)
+  {
+    PurityChecker Checker(T, NoSymbol, IsConstBase);
+    Checker.visit(Body);
+    if (!Checker.Pure)
+      return None;
+
+    IntegerTypes Types;
+    Types.run(T, {}, Body, getMaxExact());
+    ConstBudget Budget;
+    return ConstEvaluator(T, Types, Budget, nullptr).run({}, {}, Body);
   }
 
-  static std::unique_ptr<ExprAST> ParseIfExpr()
+  // Recursive descent parser reading tokens from a Lexer into a Tree. The
+  // main loop runs one Parser over the whole input, --parallel-parse runs
+  // one per chunk (see ParseChunk).
+  class Parser
+  {
+  public:
+    Lexer *Lex;
+    Tree &ASTTree;
+    std::map<char, int> &Precedence;
+    int CurTok = 0;
+
+    // Operator characters whose precedence was looked up before this parser
+    // defined them itself, and the ones it defined.
+    std::bitset<128> Consulted, Defined;
+    // Speculative parsers register 'base binary' precedences as soon as the
+    // definition is parsed and collect errors in Errors instead of printing.
+    bool Speculative = false;
+    std::string Errors;
+
+    Parser(Lexer *Lex, Tree &ASTTree, std::map<char, int> &Precedence)
+        : Lex(Lex), ASTTree(ASTTree), Precedence(Precedence) {}
+
+    int getNextToken();
+    ExprRef LogError(const char *Str);
+    std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
+    int GetTokPrecedence();
+
+    ExprRef ParseExpression();
+    ExprRef ParseIdentifierExpr();
+    ExprRef ParseIfExpr();
+    ExprRef ParseForExpr();
+    ExprRef ParseVarExpr();
+    ExprRef ParsePrimary();
+    ExprRef ParseUnary();
+    ExprRef ParseBinOpRHS(int ExprPrec, ExprRef LHS);
+    ExprRef ParseNumberExpr();
+    ExprRef ParseParenExpr();
+    ExprRef ParseScopeExpr();
+    ExprRef ParseSpawnExpr();
+    ExprRef ParseSyncExpr();
+    std::unique_ptr<PrototypeAST> ParsePrototype();
+    std::unique_ptr<FunctionAST> ParseDefinition();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+  };
+
+  ExprRef Parser::ParseIfExpr()
   {
     getNextToken();
 
     // condition.
     auto Cond = ParseExpression();
     if (!Cond)
-      return nullptr;
+      return ExprRef();
 
     if (CurTok != tok_then)
       return LogError("expected then");
@@ -908,7 +3311,7 @@ namespace
 
     auto Then = ParseExpression();
     if (!Then)
-      return nullptr;
+      return ExprRef();
 
     if (CurTok != tok_else)
       return LogError("expected else");
@@ -917,16 +3320,25 @@ namespace
 
     auto Else = ParseExpression();
     if (!Else)
-      return nullptr;
+      return ExprRef();
+
+    return ASTTree.add(IfExpr{Cond, Then, Else});
+  }
 
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                       std::move(Else));
+  // Under --precision=f32 only pizza functions work in floats: sauce
+  // functions are C functions and top-level expressions are called from C++,
+  // so both keep the double ABI. A name keeps the ABI of its first prototype,
+  // which calls already compiled against it rely on.
+  static bool HasHostABI(Symbol Name)
+  {
+    auto FI = FunctionProtos.find(Name);
+    return FI != FunctionProtos.end() && FI->second->usesHostABI();
   }
 
-  Function *getFunction(const std::string &Name)
+  Function *getFunction(Symbol Name)
   {
     // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(Name))
+    if (auto *F = ModuleFunctions.lookup(Name))
       return F;
 
     // If not, check whether we can codegen the declaration from some existing
@@ -939,18 +3351,29 @@ namespace
     return nullptr;
   }
 
-  static int getNextToken()
+  int Parser::getNextToken()
   {
-    return CurTok = gettok();
+    return CurTok = Lex->gettok();
   }
 
-  std::unique_ptr<ExprAST> LogError(const char *Str)
+  ExprRef LogError(const char *Str)
   {
     fprintf(stderr, "LogError: %s\n", Str);
-    return nullptr;
+    return ExprRef();
   }
 
-  std::unique_ptr<PrototypeAST> LogErrorP(const char *Str)
+  ExprRef Parser::LogError(const char *Str)
+  {
+    if (!Speculative)
+      return ::LogError(Str);
+
+    Errors += "LogError: ";
+    Errors += Str;
+    Errors += "\n";
+    return ExprRef();
+  }
+
+  std::unique_ptr<PrototypeAST> Parser::LogErrorP(const char *Str)
   {
     LogError(Str);
     return nullptr;
@@ -962,47 +3385,62 @@ namespace
     return nullptr;
   }
 
-  static int GetTokPrecedence()
+  int Parser::GetTokPrecedence()
   {
     if (!isascii(CurTok))
       return -1;
 
+    if (!Defined.test(CurTok))
+      Consulted.set(CurTok);
+
     // Make sure it's a declared binop.
-    int TokPrec = BinopPrecedence[CurTok];
+    int TokPrec = Precedence[CurTok];
     if (TokPrec <= 0)
       return -1;
     return TokPrec;
   }
 
-  static std::unique_ptr<ExprAST> ParseExpression()
+  ExprRef Parser::ParseExpression()
   {
     auto LHS = ParseUnary();
     if (!LHS)
-      return nullptr;
+      return ExprRef();
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
   }
 
-  static std::unique_ptr<ExprAST> ParseIdentifierExpr()
+  ExprRef Parser::ParseIdentifierExpr()
   {
-    std::string IdName = IdentifierStr;
+    Symbol IdName = Lex->getIdentifier();
 
     getNextToken(); // eat identifier.
 
+    if (CurTok == '[') // Array element.
+    {
+      getNextToken(); // eat [
+      auto Index = ParseExpression();
+      if (!Index)
+        return ExprRef();
+      if (CurTok != ']')
+        return LogError("expected ']'");
+      getNextToken(); // eat ]
+      return ASTTree.add(IndexExpr{IdName, Index});
+    }
+
     if (CurTok != '(') // Simple variable ref.
-      return std::make_unique<VariableExprAST>(IdName);
+      return ASTTree.add(VariableExpr{IdName});
 
     // Call.
     getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    SmallVector<ExprRef, 4> Args;
     if (CurTok != ')')
     {
       while (1)
       {
         if (auto Arg = ParseExpression())
-          Args.push_back(std::move(Arg));
+          Args.push_back(Arg);
         else
-          return nullptr;
+          return ExprRef();
 
         if (CurTok == ')')
           break;
@@ -1016,17 +3454,17 @@ namespace
     // Eat the ')'.
     getNextToken();
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return ASTTree.add(CallExpr{IdName, ASTTree.addList(Args)});
   }
 
-  static std::unique_ptr<ExprAST> ParseForExpr()
+  ExprRef Parser::ParseForExpr()
   {
     getNextToken(); // eat the for.
 
     if (CurTok != tok_identifier)
       return LogError("expected identifier after for");
 
-    std::string IdName = IdentifierStr;
+    Symbol IdName = Lex->getIdentifier();
     getNextToken(); // eat identifier.
 
     if (CurTok != '=')
@@ -1035,23 +3473,46 @@ namespace
 
     auto Start = ParseExpression();
     if (!Start)
-      return nullptr;
+      return ExprRef();
     if (CurTok != ',')
       return LogError("expected ',' after for start value");
     getNextToken();
 
     auto End = ParseExpression();
     if (!End)
-      return nullptr;
+      return ExprRef();
 
     // The step value is optional.
-    std::unique_ptr<ExprAST> Step;
+    ExprRef Step;
     if (CurTok == ',')
     {
       getNextToken();
       Step = ParseExpression();
       if (!Step)
-        return nullptr;
+        return ExprRef();
+    }
+
+    // So are "parallel" and the reduction; their names are only keywords
+    // here.
+    bool Parallel = false;
+    if (CurTok == tok_identifier && Symbols.name(Lex->getIdentifier()) == "parallel")
+    {
+      Parallel = true;
+      getNextToken();
+    }
+
+    Reduction Reduce = Reduction::None;
+    if (CurTok == tok_identifier)
+    {
+      Reduce = StringSwitch<Reduction>(Symbols.name(Lex->getIdentifier()))
+                   .Case("sum", Reduction::Sum)
+                   .Case("product", Reduction::Product)
+                   .Case("min", Reduction::Min)
+                   .Case("max", Reduction::Max)
+                   .Default(Reduction::None);
+      if (Reduce == Reduction::None)
+        return LogError("expected sum, product, min or max after for");
+      getNextToken();
     }
 
     if (CurTok != tok_in)
@@ -1060,18 +3521,16 @@ namespace
 
     auto Body = ParseExpression();
     if (!Body)
-      return nullptr;
+      return ExprRef();
 
-    return std::make_unique<ForExprAST>(IdName, std::move(Start),
-                                        std::move(End), std::move(Step),
-                                        std::move(Body));
+    return ASTTree.add(ForExpr{IdName, Start, End, Step, Body, Reduce, Parallel});
   }
 
-  static std::unique_ptr<ExprAST> ParseVarExpr()
+  ExprRef Parser::ParseVarExpr()
   {
     getNextToken();
 
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    SmallVector<VarBinding, 4> VarNames;
 
     // At least one variable name is required.
     if (CurTok != tok_identifier)
@@ -1080,21 +3539,32 @@ namespace
     while (1)
     {
 
-      std::string Name = IdentifierStr;
+      Symbol Name = Lex->getIdentifier();
       getNextToken();
 
-      // Read the optional initializer.
-      std::unique_ptr<ExprAST> Init;
+      // Read the optional initializer, or an array's length.
+      ExprRef Init, Length;
       if (CurTok == '=')
       {
         getNextToken(); // eat the '='.
 
         Init = ParseExpression();
         if (!Init)
-          return nullptr;
+          return ExprRef();
+      }
+      else if (CurTok == '[')
+      {
+        getNextToken(); // eat the '['.
+
+        Length = ParseExpression();
+        if (!Length)
+          return ExprRef();
+        if (CurTok != ']')
+          return LogError("expected ']' after array length");
+        getNextToken(); // eat the ']'.
       }
 
-      VarNames.push_back(std::make_pair(Name, std::move(Init)));
+      VarNames.push_back({Name, Init, Length});
 
       // End of var list, exit loop.
       if (CurTok != ',')
@@ -1109,16 +3579,15 @@ namespace
       getNextToken(); // eat 'in'.
 
       auto Body = ParseExpression();
-      return std::make_unique<VarExprAST>(std::move(VarNames),
-                                          std::move(Body));
+      return ASTTree.add(VarExpr{ASTTree.addBindings(VarNames), Body});
     }
     else
     {
-      return std::make_unique<VarExprAST>(std::move(VarNames));
+      return ASTTree.add(VarExpr{ASTTree.addBindings(VarNames), ExprRef()});
     }
   }
 
-  static std::unique_ptr<ExprAST> ParsePrimary()
+  ExprRef Parser::ParsePrimary()
   {
     switch (CurTok)
     {
@@ -1138,10 +3607,14 @@ namespace
       return ParseForExpr();
     case tok_topping:
       return ParseVarExpr();
+    case tok_spawn:
+      return ParseSpawnExpr();
+    case tok_sync:
+      return ParseSyncExpr();
     }
   }
 
-  static std::unique_ptr<ExprAST> ParseUnary()
+  ExprRef Parser::ParseUnary()
   {
     // If the current token is not an operator, it must be a primary expr.
     if (!isascii(CurTok) || CurTok == '(' || CurTok == ',' || CurTok == '{')
@@ -1151,12 +3624,11 @@ namespace
     int Opc = CurTok;
     getNextToken();
     if (auto Operand = ParseUnary())
-      return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
-    return nullptr;
+      return ASTTree.add(UnaryExpr{(char)Opc, Operand});
+    return ExprRef();
   }
 
-  static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                                std::unique_ptr<ExprAST> LHS)
+  ExprRef Parser::ParseBinOpRHS(int ExprPrec, ExprRef LHS)
   {
     while (1)
     {
@@ -1169,33 +3641,32 @@ namespace
 
       auto RHS = ParseUnary();
       if (!RHS)
-        return nullptr;
+        return ExprRef();
 
       int NextPrec = GetTokPrecedence();
       if (TokPrec < NextPrec)
       {
-        RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+        RHS = ParseBinOpRHS(TokPrec + 1, RHS);
         if (!RHS)
-          return nullptr;
+          return ExprRef();
       }
-      LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS),
-                                            std::move(RHS));
+      LHS = ASTTree.add(BinaryExpr{(char)BinOp, LHS, RHS});
     }
   }
 
-  static std::unique_ptr<ExprAST> ParseNumberExpr()
+  ExprRef Parser::ParseNumberExpr()
   {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+    auto Result = ASTTree.add(NumberExpr{Lex->getNumVal()});
     getNextToken();
-    return std::move(Result);
+    return Result;
   }
 
-  static std::unique_ptr<ExprAST> ParseParenExpr()
+  ExprRef Parser::ParseParenExpr()
   {
     getNextToken();
     auto V = ParseExpression();
     if (!V)
-      return nullptr;
+      return ExprRef();
 
     if (CurTok != ')')
       return LogError("expected ')'");
@@ -1203,26 +3674,46 @@ namespace
     return V;
   }
 
-  static std::unique_ptr<ExprAST> ParseScopeExpr()
+  ExprRef Parser::ParseScopeExpr()
   {
-    std::vector<std::unique_ptr<ExprAST>> v;
+    SmallVector<ExprRef, 8> v;
     getNextToken();
     while (CurTok != '}')
     {
       auto V = ParseExpression();
       if (!V)
-        return nullptr;
-      v.push_back(std::move(V));
+        return ExprRef();
+      v.push_back(V);
       getNextToken();
     };
     getNextToken();
 
-    return std::make_unique<ScopeExprAST>(std::move(v));
+    return ASTTree.add(ScopeExpr{ASTTree.addList(v)});
+  }
+
+  ExprRef Parser::ParseSpawnExpr()
+  {
+    getNextToken(); // eat the spawn.
+
+    if (CurTok != tok_identifier)
+      return LogError("expected a call after spawn");
+    auto Call = ParseIdentifierExpr();
+    if (!Call)
+      return ExprRef();
+    if (Call.getKind() != ExprKind::Call)
+      return LogError("expected a call after spawn");
+    return ASTTree.add(SpawnExpr{Call});
+  }
+
+  ExprRef Parser::ParseSyncExpr()
+  {
+    getNextToken(); // eat the sync.
+    return ASTTree.add(SyncExpr{});
   }
 
-  static std::unique_ptr<PrototypeAST> ParsePrototype()
+  std::unique_ptr<PrototypeAST> Parser::ParsePrototype()
   {
-    std::string FnName;
+    Symbol FnName;
 
     unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
     unsigned BinaryPrecedence = 30;
@@ -1232,7 +3723,7 @@ namespace
     default:
       return LogErrorP("Expected function name in prototype");
     case tok_identifier:
-      FnName = IdentifierStr;
+      FnName = Lex->getIdentifier();
       Kind = 0;
       getNextToken();
       break;
@@ -1240,8 +3731,7 @@ namespace
       getNextToken();
       if (!isascii(CurTok))
         return LogErrorP("Expected unary operator");
-      FnName = "unary";
-      FnName += (char)CurTok;
+      FnName = getOperatorSymbol(false, CurTok);
       Kind = 1;
       getNextToken();
       break;
@@ -1249,153 +3739,484 @@ namespace
       getNextToken();
       if (!isascii(CurTok))
         return LogErrorP("Expected binary operator");
-      FnName = "binary";
-      FnName += (char)CurTok;
+      FnName = getOperatorSymbol(true, CurTok);
       Kind = 2;
       getNextToken();
 
       // Read the precedence if present.
       if (CurTok == tok_number)
       {
-        if (NumVal < 1 || NumVal > 100)
+        if (Lex->getNumVal() < 1 || Lex->getNumVal() > 100)
           return LogErrorP("Invalid precedence: must be 1..100");
-        BinaryPrecedence = (unsigned)NumVal;
+        BinaryPrecedence = (unsigned)Lex->getNumVal();
         getNextToken();
       }
       break;
     }
 
-    if (CurTok != '(')
-      return LogErrorP("Expected '(' in prototype");
-
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-      ArgNames.push_back(IdentifierStr);
-    if (CurTok != ')')
-      return LogErrorP("Expected ')' in prototype");
-
-    // success.
-    getNextToken(); // eat ')'.
+    if (CurTok != '(')
+      return LogErrorP("Expected '(' in prototype");
+
+    std::vector<Symbol> ArgNames;
+    while (getNextToken() == tok_identifier)
+      ArgNames.push_back(Lex->getIdentifier());
+    if (CurTok != ')')
+      return LogErrorP("Expected ')' in prototype");
+
+    // success.
+    getNextToken(); // eat ')'.
+
+    // Verify right number of names for operator.
+    if (Kind && ArgNames.size() != Kind)
+      return LogErrorP("Invalid number of operands for operator");
+
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0,
+                                          BinaryPrecedence);
+  }
+
+  std::unique_ptr<FunctionAST> Parser::ParseDefinition()
+  {
+    getNextToken();
+
+    auto Proto = ParsePrototype();
+    if (!Proto)
+      return nullptr;
+
+    auto E = ParseExpression();
+    if (!E)
+      return nullptr;
+
+    if (Speculative && Proto->isBinaryOp())
+    {
+      Precedence[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
+      Defined.set(Proto->getOperatorName());
+    }
+
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
+  }
+
+  std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr()
+  {
+    if (auto E = ParseExpression())
+    {
+      auto Proto = std::make_unique<PrototypeAST>(AnonExprSym, std::vector<Symbol>());
+      return std::make_unique<FunctionAST>(std::move(Proto), E);
+    }
+    return nullptr;
+  }
+
+  std::unique_ptr<PrototypeAST> Parser::ParseExtern()
+  {
+    getNextToken();
+    return ParsePrototype();
+  }
+
+  static std::unique_ptr<Parser> TheParser;
+
+  // Prints how long an item took from the start of codegen until it was
+  // ready to run, for --time-compile.
+  static void ReportCompileTime(StringRef Name, std::chrono::steady_clock::time_point Start)
+  {
+    if (!timeCompile)
+      return;
+    std::chrono::duration<double, std::milli> Elapsed = std::chrono::steady_clock::now() - Start;
+    fprintf(stderr, "compiled '%s' in %.3f ms\n", Name.str().c_str(), Elapsed.count());
+  }
+
+  // Top-level expressions --whole-program will run, in source order.
+  static std::vector<std::string> PendingExprs;
+
+  static void SaveForInlining(Function &F)
+  {
+    ValueToValueMapTy VMap;
+    auto M = CloneModule(*F.getParent(), VMap, [&](const GlobalValue *GV)
+                         { return GV == &F; });
+    cast<Function>(VMap[&F])->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    std::string &Bitcode = OptimizedBodies[F.getName()];
+    Bitcode.clear();
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(*M, OS);
+  }
+
+  // Links the saved bodies of the bases TheModule calls into it, and then of
+  // the bases those call, before the module is optimized.
+  static void ImportForInlining()
+  {
+    if (!TheMPM || !TheMPM->inlines() || OptimizedBodies.empty())
+      return;
+
+    StringSet<> Imported;
+    std::vector<std::string> Wanted;
+    do
+    {
+      Wanted.clear();
+      for (Function &F : *TheModule)
+        if (F.isDeclaration() && OptimizedBodies.count(F.getName()) &&
+            Imported.insert(F.getName()).second)
+          Wanted.push_back(F.getName().str());
+
+      for (const std::string &Name : Wanted)
+      {
+        auto M = parseBitcodeFile(MemoryBufferRef(OptimizedBodies[Name], Name), *TheContext);
+        if (!M)
+        {
+          consumeError(M.takeError());
+          continue;
+        }
+        Linker::linkModules(*TheModule, std::move(*M));
+      }
+    } while (!Wanted.empty());
+  }
+
+  // Drops TheModule, and what was generated into it, without running it.
+  static void DiscardModule()
+  {
+    Builder.reset();
+    TheFPM.reset();
+    TheModule.reset();
+    InitializeModuleAndPassManager();
+  }
+
+  static void EmitTopLevelExpression(FunctionAST &FnAST, const Tree &T)
+  {
+    if (jsonFile)
+    {
+      *jsonFile << ',';
+      FnAST.dump(*jsonFile, T);
+      *jsonFile << '\n';
+    }
+    auto Start = std::chrono::steady_clock::now();
+    if (auto *FnIR = FnAST.codegen(T))
+    {
+      if (wholeProgram)
+      {
+        // Runs once the whole program is compiled, under its own name.
+        FnIR->setName("__anon_expr." + Twine(PendingExprs.size()));
+        ModuleFunctions.erase(AnonExprSym);
+        PendingExprs.push_back(FnIR->getName().str());
+        return;
+      }
+
+      // The expression is still compiled first: that reports its errors,
+      // including ones in branches evaluation never takes.
+      Optional<double> Folded = EvaluateTopLevelExpression(T, FnAST.getBody());
+      if (!Folded || llFile)
+      {
+        ImportForInlining();
+        if (TheMPM)
+          TheMPM->run(*TheModule);
+      }
+      if (llFile)
+      {
+        FnIR->print(*llFile);
+        for (Function *Body : ParallelBodies)
+          Body->print(*llFile);
+      }
+
+      if (Folded)
+      {
+        DiscardModule();
+        ReportCompileTime(Symbols.name(FnAST.getName()), Start);
+        if (replMode)
+          fprintf(stderr, "Evaluated to %f\n", *Folded);
+        return;
+      }
+
+      auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+      auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+      InitializeModuleAndPassManager();
+
+      auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+      assert(ExprSymbol && "Function not found");
+      ReportCompileTime(Symbols.name(FnAST.getName()), Start);
+      double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+      if (replMode)
+        fprintf(stderr, "Evaluated to %f\n", FP());
+      else
+        FP();
+
+      ExitOnErr(RT->remove());
+    }
+  }
+
+  // Makes glibc's vector math library visible to the JIT, so vectorized
+  // loops can call it. The library only exists on x86-64 Linux.
+  static bool LoadVectorMathLibrary()
+  {
+    Triple Host(sys::getProcessTriple());
+    if (Host.getArch() != Triple::x86_64 || !Host.isOSLinux())
+      return false;
+    return !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+  }
+
+  // The x86 features --target-clones versions bases for, in increasing
+  // preference, with their bit in compiler-rt's __cpu_model.
+  static std::vector<std::pair<std::string, uint32_t>> TargetClones;
+
+  static bool ParseTargetClones(ArrayRef<std::string> Features)
+  {
+    if (Features.empty())
+      return true;
+    if (!Triple(sys::getProcessTriple()).isX86())
+    {
+      fprintf(stderr, "--target-clones needs an x86 host\n");
+      return false;
+    }
+    for (const std::string &Feature : Features)
+    {
+      unsigned Bit = StringSwitch<unsigned>(Feature)
+#define X86_FEATURE_COMPAT(ENUM, STR, ...) .Case(STR, X86::FEATURE_##ENUM)
+#include <llvm/Support/X86TargetParser.def>
+                         .Default(~0u);
+      // Later features live in __cpu_features2.
+      if (Bit >= 32)
+      {
+        fprintf(stderr, "Unsupported --target-clones feature '%s'\n", Feature.c_str());
+        return false;
+      }
+      TargetClones.emplace_back(Feature, 1u << Bit);
+    }
+    return true;
+  }
+
+  // Prints a base to the llPath output. With --target-clones it becomes a
+  // "name.default" version and one per feature, behind an ifunc whose
+  // resolver picks the most preferred version the CPU supports when the
+  // program is loaded. The extra functions only exist while printing; the
+  // JIT compiles the base for the CPU it runs on as usual.
+  static void PrintDefinition(Function &F)
+  {
+    if (TargetClones.empty() || !F.hasExternalLinkage() || F.getName().startswith("__anon_expr"))
+    {
+      F.print(*llFile);
+      return;
+    }
 
-    // Verify right number of names for operator.
-    if (Kind && ArgNames.size() != Kind)
-      return LogErrorP("Invalid number of operands for operator");
+    std::string Name = F.getName().str();
+    F.setName(Name + ".default");
+    SmallVector<Function *, 4> Clones;
+    for (const auto &Target : TargetClones)
+    {
+      ValueToValueMapTy VMap;
+      Function *Clone = CloneFunction(&F, VMap);
+      Clone->setName(Name + "." + Target.first);
+      Clone->setLinkage(GlobalValue::InternalLinkage);
+      Clone->addFnAttr("target-features", "+" + Target.first);
+      // Recursion stays in the version the resolver picked.
+      F.replaceUsesWithIf(Clone, [Clone](Use &U)
+                          {
+                            auto *I = dyn_cast<Instruction>(U.getUser());
+                            return I && I->getFunction() == Clone;
+                          });
+      Clones.push_back(Clone);
+    }
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0,
-                                          BinaryPrecedence);
+    Type *Int32Ty = Type::getInt32Ty(*TheContext);
+    StructType *CpuModelTy = StructType::get(Int32Ty, Int32Ty, Int32Ty, ArrayType::get(Int32Ty, 1));
+    auto *CpuModel = cast<GlobalVariable>(TheModule->getOrInsertGlobal("__cpu_model", CpuModelTy));
+    FunctionCallee CpuInit = TheModule->getOrInsertFunction("__cpu_indicator_init", Type::getVoidTy(*TheContext));
+
+    Function *Resolver = Function::Create(FunctionType::get(F.getType(), false),
+                                          Function::InternalLinkage, Name + ".resolver", TheModule.get());
+    IRBuilder<> B(BasicBlock::Create(*TheContext, "entry", Resolver));
+    B.CreateCall(CpuInit);
+    Value *FeaturesPtr = B.CreateInBoundsGEP(CpuModelTy, CpuModel, {B.getInt32(0), B.getInt32(3), B.getInt32(0)});
+    Value *Features = B.CreateLoad(Int32Ty, FeaturesPtr, "features");
+    Value *Picked = &F;
+    for (size_t I = 0; I != Clones.size(); I++)
+    {
+      Value *Mask = B.getInt32(TargetClones[I].second);
+      Value *Has = B.CreateICmpEQ(B.CreateAnd(Features, Mask), Mask, "has." + TargetClones[I].first);
+      Picked = B.CreateSelect(Has, Clones[I], Picked);
+    }
+    B.CreateRet(Picked);
+
+    GlobalIFunc *IFunc = GlobalIFunc::create(F.getFunctionType(), 0, GlobalValue::ExternalLinkage,
+                                             Name, Resolver, TheModule.get());
+
+    F.print(*llFile);
+    for (Function *Clone : Clones)
+      Clone->print(*llFile);
+    Resolver->print(*llFile);
+    IFunc->print(*llFile);
+    *llFile << '\n';
+
+    // Functions print references to attribute groups numbered across the
+    // whole module, so take the clones' definitions from its listing.
+    std::string Listing;
+    raw_string_ostream ListingOS(Listing);
+    TheModule->print(ListingOS, nullptr);
+    SmallVector<StringRef, 64> Lines;
+    StringRef(ListingOS.str()).split(Lines, '\n');
+    for (StringRef Line : Lines)
+      if (Line.startswith("attributes #") && Line.contains("\"target-features\""))
+        *llFile << Line << '\n';
+
+    IFunc->eraseFromParent();
+    Resolver->eraseFromParent();
+    for (Function *Clone : Clones)
+      Clone->eraseFromParent();
+    if (CpuModel->use_empty())
+      CpuModel->eraseFromParent();
+    auto *Init = cast<Function>(CpuInit.getCallee());
+    if (Init->use_empty())
+      Init->eraseFromParent();
+    F.setName(Name);
   }
 
-  static std::unique_ptr<FunctionAST> ParseDefinition()
+  static void EmitDefinition(FunctionAST &FnAST, const Tree &T)
   {
-    getNextToken();
+    if (jsonFile)
+    {
+      *jsonFile << ',';
+      FnAST.dump(*jsonFile, T);
+      *jsonFile << '\n';
+    }
 
-    auto Proto = ParsePrototype();
-    if (!Proto)
-      return nullptr;
+    auto Start = std::chrono::steady_clock::now();
+    if (auto *FnIR = FnAST.codegen(T))
+    {
+      if (wholeProgram)
+        return;
+      AddConstBase(T, FnAST.getName(), FnAST.getBody());
 
-    auto E = ParseExpression();
-    if (!E)
-      return nullptr;
+      ImportForInlining();
+      if (TheMPM)
+      {
+        TheMPM->run(*TheModule);
+        if (TheMPM->inlines())
+          SaveForInlining(*FnIR);
+      }
+      if (llFile)
+      {
+        PrintDefinition(*FnIR);
+        if (Function *Batch = TheModule->getFunction((FnIR->getName() + "__batch").str()))
+          PrintDefinition(*Batch);
+        for (Function *Body : ParallelBodies)
+          PrintDefinition(*Body);
+      }
 
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+      if (replMode)
+        fprintf(stderr, "New base '%s' available\n", Symbols.name(FnAST.getName()).str().c_str());
+      ExitOnErr(TheJIT->addModule(
+          llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+      InitializeModuleAndPassManager();
+      ReportCompileTime(Symbols.name(FnAST.getName()), Start);
+    }
   }
 
-  static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
+  // Reports how well each memo table did, for --stats.
+  static void PrintStats()
   {
-    if (auto E = ParseExpression())
+    for (const auto &Entry : MemoTables)
     {
-      auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-      return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+      uint64_t Calls = Entry.second->calls();
+      uint64_t Hits = Entry.second->hits();
+      fprintf(stderr, "memo '%s': %llu calls, %llu hits (%.1f%%)\n",
+              Symbols.name(Entry.first).str().c_str(), (unsigned long long)Calls,
+              (unsigned long long)Hits, Calls ? 100.0 * Hits / Calls : 0.0);
     }
-    return nullptr;
   }
 
-  static std::unique_ptr<PrototypeAST> ParseExtern()
+  // Optimizes the module --whole-program collected every item into, hands
+  // it to the JIT, and runs the top-level expressions in source order.
+  static void EmitWholeProgram(std::chrono::steady_clock::time_point Start)
   {
-    getNextToken();
-    return ParsePrototype();
+    TheMPM->run(*TheModule);
+    if (llFile)
+    {
+      // Printing may add functions to the module for a moment.
+      std::vector<Function *> Definitions;
+      for (Function &F : *TheModule)
+        if (!F.isDeclaration())
+          Definitions.push_back(&F);
+      for (Function *F : Definitions)
+        PrintDefinition(*F);
+    }
+
+    ExitOnErr(TheJIT->addModule(
+        llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+    InitializeModuleAndPassManager();
+
+    std::vector<double (*)()> Exprs;
+    for (const std::string &Name : PendingExprs)
+      Exprs.push_back((double (*)())(intptr_t)ExitOnErr(TheJIT->lookup(Name)).getAddress());
+    ReportCompileTime("<program>", Start);
+
+    for (auto *FP : Exprs)
+      FP();
   }
 
-  static void HandleTopLevelExpression()
+  static void EmitExtern(std::unique_ptr<PrototypeAST> ProtoAST)
   {
-    if (auto FnAST = ParseTopLevelExpr())
+    if (jsonFile)
     {
-      if (jsonFile.is_open())
-        jsonFile << "," << FnAST->dump() << std::endl;
-      if (auto *FnIR = FnAST->codegen())
-      {
-        if (llFile)
-          FnIR->print(*llFile);
-
-        auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-        auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-        ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-        InitializeModuleAndPassManager();
+      *jsonFile << ",{\"extern\":";
+      ProtoAST->dump(*jsonFile);
+      *jsonFile << "}\n";
+    }
 
-        auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-        assert(ExprSymbol && "Function not found");
-        double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-        if (replMode)
-          fprintf(stderr, "Evaluated to %f\n", FP());
-        else
-          FP();
+    ProtoAST->setHostABI(!FunctionProtos.count(ProtoAST->getName()) ||
+                         HasHostABI(ProtoAST->getName()));
+    if (auto *FnIR = ProtoAST->codegen())
+    {
+      if (llFile && FnIR->isDeclaration())
+        FnIR->print(*llFile);
 
-        ExitOnErr(RT->remove());
-      }
+      if (replMode)
+        fprintf(stderr, "New sauce '%s' available\n", Symbols.name(ProtoAST->getName()).str().c_str());
+      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
     }
+  }
+
+  static void HandleTopLevelExpression()
+  {
+    if (auto FnAST = TheParser->ParseTopLevelExpr())
+      EmitTopLevelExpression(*FnAST, ASTTree);
     else
     {
       // Skip token for error recovery.
-      getNextToken();
+      TheParser->getNextToken();
     }
+
+    // Drop the whole tree at once.
+    ASTTree.clear();
   }
 
   static void HandleDefinition()
   {
-    if (auto FnAST = ParseDefinition())
-    {
-      if (jsonFile.is_open())
-        jsonFile << "," << FnAST->dump() << std::endl;
+    if (auto FnAST = TheParser->ParseDefinition())
+      EmitDefinition(*FnAST, ASTTree);
+    else
+      TheParser->getNextToken();
 
-      if (auto *FnIR = FnAST->codegen())
-      {
-        if (llFile)
-          FnIR->print(*llFile);
+    ASTTree.clear();
+  }
 
-        if (replMode)
-          fprintf(stderr, "New base '%s' available\n", FnAST->getName().c_str());
-        ExitOnErr(TheJIT->addModule(
-            llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-        InitializeModuleAndPassManager();
-      }
-    }
+  static void HandleExtern()
+  {
+    if (auto ProtoAST = TheParser->ParseExtern())
+      EmitExtern(std::move(ProtoAST));
     else
     {
-      getNextToken();
+      // Skip token for error recovery.
+      TheParser->getNextToken();
     }
   }
 
-  static void HandleExtern()
+  static CodeGenOpt::Level CodeGenOptLevel(char Level)
   {
-    if (auto ProtoAST = ParseExtern())
-    {
-      if (jsonFile.is_open())
-        jsonFile << ",{\"extern\":" << ProtoAST->dump() << "}" << std::endl;
-
-      if (auto *FnIR = ProtoAST->codegen())
-      {
-        if (llFile)
-          FnIR->print(*llFile);
-
-        if (replMode)
-          fprintf(stderr, "New sauce '%s' available\n", ProtoAST->getName().c_str());
-        FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
-      }
-    }
-    else
+    switch (Level)
     {
-      // Skip token for error recovery.
-      getNextToken();
+    case '0':
+      return CodeGenOpt::None;
+    case '1':
+      return CodeGenOpt::Less;
+    case '3':
+      return CodeGenOpt::Aggressive;
+    default:
+      return CodeGenOpt::Default;
     }
   }
 
@@ -1403,30 +4224,128 @@ namespace
   {
     TheContext = std::make_unique<LLVMContext>();
     TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+    ModuleFunctions.clear();
     TheModule->setDataLayout(TheJIT->getDataLayout());
+    ModuleSpecializations.clear();
     Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+    if (TheMPM)
+      return;
+
     TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
     TheFPM->add(createPromoteMemoryToRegisterPass());
-    TheFPM->add(createInstructionCombiningPass());
-    TheFPM->add(createReassociatePass());
-    TheFPM->add(createGVNPass());
-    TheFPM->add(createCFGSimplificationPass());
+    // Fast compiles keep only mem2reg, which leaves instruction selection
+    // far less to do for the price of one cheap pass.
+    if (!fastCompile)
+    {
+      TheFPM->add(createInstructionCombiningPass());
+      TheFPM->add(createReassociatePass());
+      TheFPM->add(createGVNPass());
+      TheFPM->add(createCFGSimplificationPass());
+    }
 
     TheFPM->doInitialization();
   }
 
+  // Lexes the whole input without parsing it and reports the throughput.
+  static int BenchLexer()
+  {
+    auto Start = std::chrono::steady_clock::now();
+    size_t Tokens = 0;
+    while (Lex->gettok() != tok_eof)
+      Tokens++;
+    std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+
+    double MB = Src->size() / (1024.0 * 1024.0);
+    fprintf(stderr, "lexed %zu tokens, %.2f MB in %.3f s (%.2f MB/s)\n",
+            Tokens, MB, Elapsed.count(), MB / Elapsed.count());
+    return 0;
+  }
+
+  // Parses the whole input without generating code and reports how fast the
+  // items are written out as JSON. The JSON is also written to jsonPath when
+  // one is given.
+  static int BenchJSON()
+  {
+    Parser P(Lex.get(), ASTTree, BinopPrecedence);
+    // Nothing is code-generated, so operator precedences have to be picked
+    // up while parsing.
+    P.Speculative = true;
+    P.getNextToken();
+
+    SmallString<4096> Buf;
+    raw_svector_ostream OS(Buf);
+    std::chrono::duration<double> Elapsed(0);
+    size_t Items = 0, Bytes = 0;
+    while (P.CurTok != tok_eof)
+    {
+      if (P.CurTok == ';')
+      {
+        P.getNextToken();
+        continue;
+      }
+
+      std::unique_ptr<FunctionAST> FnAST;
+      std::unique_ptr<PrototypeAST> ProtoAST;
+      if (P.CurTok == tok_base)
+        FnAST = P.ParseDefinition();
+      else if (P.CurTok == tok_sauce)
+        ProtoAST = P.ParseExtern();
+      else
+        FnAST = P.ParseTopLevelExpr();
+      fputs(P.Errors.c_str(), stderr);
+      P.Errors.clear();
+
+      if (!FnAST && !ProtoAST)
+      {
+        P.getNextToken();
+        ASTTree.clear();
+        continue;
+      }
+
+      Buf.clear();
+      auto Start = std::chrono::steady_clock::now();
+      if (FnAST)
+        FnAST->dump(OS, ASTTree);
+      else
+      {
+        OS << "{\"extern\":";
+        ProtoAST->dump(OS);
+        OS << '}';
+      }
+      Elapsed += std::chrono::steady_clock::now() - Start;
+
+      Items++;
+      Bytes += Buf.size();
+      if (jsonFile)
+        *jsonFile << ',' << Buf << '\n';
+      ASTTree.clear();
+    }
+
+    if (jsonFile)
+    {
+      *jsonFile << ",\"end\"]}\n";
+      jsonFile->close();
+    }
+
+    double MB = Bytes / (1024.0 * 1024.0);
+    fprintf(stderr, "dumped %zu items, %.2f MB of JSON in %.3f s (%.2f MB/s)\n",
+            Items, MB, Elapsed.count(), MB / Elapsed.count());
+    return 0;
+  }
+
   static void MainLoop()
   {
-    while (replMode || CurTok != tok_eof)
+    while (replMode || TheParser->CurTok != tok_eof)
     {
-      switch (CurTok)
+      switch (TheParser->CurTok)
       {
       case tok_eof:
         return;
       case ';':
         if (replMode)
           fprintf(stderr, "ready> ");
-        getNextToken();
+        TheParser->getNextToken();
         break;
       case tok_base:
         HandleDefinition();
@@ -1440,6 +4359,235 @@ namespace
       }
     }
   }
+
+  // A top-level item parsed ahead of time by --parallel-parse. Errors holds
+  // the diagnostics its parse produced, printed when the item is handled so
+  // they come out in source order.
+  struct ParsedItem
+  {
+    std::unique_ptr<FunctionAST> Definition;
+    std::unique_ptr<FunctionAST> Expression;
+    std::unique_ptr<PrototypeAST> Extern;
+    std::string Errors;
+  };
+
+  // A run of whole top-level items, parsed on its own against a guess of the
+  // operator precedences in effect where it starts.
+  struct Chunk
+  {
+    const char *Begin, *End;
+    Tree ASTTree;
+    std::map<char, int> Precedence;
+    std::bitset<128> Consulted, Defined;
+    std::vector<ParsedItem> Items;
+  };
+
+  static void ParseChunk(Chunk &C, const std::map<char, int> &Incoming)
+  {
+    C.ASTTree.clear();
+    C.Items.clear();
+    C.Precedence = Incoming;
+
+    auto Slice = Pizza::Source::openRange(C.Begin, C.End);
+    Lexer L(*Slice, Symbols);
+    Parser P(&L, C.ASTTree, C.Precedence);
+    P.Speculative = true;
+    P.getNextToken();
+
+    while (P.CurTok != tok_eof)
+    {
+      ParsedItem Item;
+      switch (P.CurTok)
+      {
+      case ';':
+        P.getNextToken();
+        continue;
+      case tok_base:
+        if (!(Item.Definition = P.ParseDefinition()))
+          P.getNextToken();
+        break;
+      case tok_sauce:
+        if (!(Item.Extern = P.ParseExtern()))
+          P.getNextToken();
+        break;
+      default:
+        if (!(Item.Expression = P.ParseTopLevelExpr()))
+          P.getNextToken();
+        break;
+      }
+      Item.Errors = std::move(P.Errors);
+      P.Errors.clear();
+      C.Items.push_back(std::move(Item));
+    }
+
+    C.Consulted = P.Consulted;
+    C.Defined = P.Defined;
+  }
+
+  static void EmitItem(ParsedItem &Item, const Tree &T)
+  {
+    fputs(Item.Errors.c_str(), stderr);
+    if (Item.Definition)
+      EmitDefinition(*Item.Definition, T);
+    else if (Item.Expression)
+      EmitTopLevelExpression(*Item.Expression, T);
+    else if (Item.Extern)
+      EmitExtern(std::move(Item.Extern));
+  }
+
+  static int precedenceOf(const std::map<char, int> &Table, char Op)
+  {
+    auto It = Table.find(Op);
+    return It == Table.end() ? 0 : It->second;
+  }
+
+  // Parses the input in chunks split at top-level ';' on a thread pool, all
+  // assuming only the builtin operators exist. Chunks are then handled in
+  // order while tracking the real precedence table; a chunk is parsed again
+  // only if it looked up an operator whose precedence an earlier 'base binary'
+  // changed.
+  static void ParallelMainLoop()
+  {
+    ThreadPool Pool;
+    const size_t MinChunkSize = 64 * 1024;
+    size_t ChunkSize = std::max(MinChunkSize, Src->size() / (Pool.getThreadCount() * 4));
+
+    std::vector<Chunk> Chunks;
+    const char *Begin = Src->begin();
+    for (const char *End : splitTopLevelItems(Src->begin(), Src->end(), ChunkSize))
+    {
+      Chunks.push_back(Chunk());
+      Chunks.back().Begin = Begin;
+      Chunks.back().End = End;
+      Begin = End;
+    }
+
+    const std::map<char, int> Builtins = BinopPrecedence;
+    std::vector<std::shared_future<void>> Parsed;
+    for (auto &C : Chunks)
+      Parsed.push_back(Pool.async([&C, &Builtins]()
+                                  { ParseChunk(C, Builtins); }));
+
+    std::map<char, int> Actual = Builtins;
+    for (size_t i = 0; i < Chunks.size(); i++)
+    {
+      Chunk &C = Chunks[i];
+      Parsed[i].wait();
+
+      for (unsigned Op = 0; Op < C.Consulted.size(); Op++)
+        if (C.Consulted.test(Op) &&
+            precedenceOf(Builtins, Op) != precedenceOf(Actual, Op))
+        {
+          ParseChunk(C, Actual);
+          break;
+        }
+
+      for (unsigned Op = 0; Op < C.Defined.size(); Op++)
+        if (C.Defined.test(Op))
+          Actual[Op] = C.Precedence[Op];
+
+      for (auto &Item : C.Items)
+        EmitItem(Item, C.ASTTree);
+
+      C.ASTTree = Tree();
+      C.Items.clear();
+    }
+  }
+
+  static void AddCachedItem(ASTCache &Cache, const ParsedItem &Item)
+  {
+    CachedItem CI = {};
+    const PrototypeAST *Proto = nullptr;
+    if (Item.Definition)
+    {
+      CI.Kind = CachedItem::Definition;
+      Proto = &Item.Definition->getProto();
+      CI.Body = Item.Definition->getBody();
+    }
+    else if (Item.Expression)
+    {
+      CI.Kind = CachedItem::Expression;
+      Proto = &Item.Expression->getProto();
+      CI.Body = Item.Expression->getBody();
+    }
+    else if (Item.Extern)
+    {
+      CI.Kind = CachedItem::Extern;
+      Proto = Item.Extern.get();
+    }
+    else
+      CI.Kind = CachedItem::Invalid;
+
+    ArrayRef<Symbol> Args;
+    if (Proto)
+    {
+      CI.Name = Proto->getName();
+      CI.IsOperator = Proto->isOperator();
+      CI.Precedence = Proto->getBinaryPrecedence();
+      Args = Proto->getArgs();
+    }
+    Cache.addItem(CI, Args, Item.Errors);
+  }
+
+  static ParsedItem LoadCachedItem(const ASTCache &Cache, const CachedItem &CI)
+  {
+    ParsedItem Item;
+    Item.Errors = Cache.getErrors(CI).str();
+    if (CI.Kind == CachedItem::Invalid)
+      return Item;
+
+    ArrayRef<Symbol> Args = Cache.getArgs(CI);
+    auto Proto = std::make_unique<PrototypeAST>(CI.Name, std::vector<Symbol>(Args.begin(), Args.end()),
+                                                CI.IsOperator, CI.Precedence);
+    if (CI.Kind == CachedItem::Definition)
+      Item.Definition = std::make_unique<FunctionAST>(std::move(Proto), CI.Body);
+    else if (CI.Kind == CachedItem::Expression)
+      Item.Expression = std::make_unique<FunctionAST>(std::move(Proto), CI.Body);
+    else
+      Item.Extern = std::move(Proto);
+    return Item;
+  }
+
+  // Runs the input from an AST cache in Dir named after the source's content
+  // hash. On a miss the whole input is parsed in one go, as a single
+  // --parallel-parse chunk, and the cache is written before anything runs.
+  static void CachedMainLoop(const std::string &Dir)
+  {
+    CacheKey Key = {};
+    Key.SourceHash = xxHash64(StringRef(Src->begin(), Src->size()));
+    Key.SourceSize = Src->size();
+    for (int Op = 0; Op < 128; Op++)
+      Key.Precedence[Op] = precedenceOf(BinopPrecedence, Op);
+
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, utohexstr(Key.SourceHash) + ".ast");
+
+    std::vector<ParsedItem> Items;
+    std::unique_ptr<ASTCache> Cache = ASTCache::load(Path, Key, Symbols);
+    if (Cache)
+    {
+      for (auto &CI : Cache->items())
+        Items.push_back(LoadCachedItem(*Cache, CI));
+    }
+    else
+    {
+      Chunk C;
+      C.Begin = Src->begin();
+      C.End = Src->end();
+      ParseChunk(C, BinopPrecedence);
+
+      Cache = std::make_unique<ASTCache>();
+      Cache->getTree() = std::move(C.ASTTree);
+      for (auto &Item : C.Items)
+        AddCachedItem(*Cache, Item);
+      if (!Cache->write(Path, Key, Symbols))
+        fprintf(stderr, "Could not write AST cache %s\n", Path.c_str());
+      Items = std::move(C.Items);
+    }
+
+    for (auto &Item : Items)
+      EmitItem(Item, Cache->getTree());
+  }
 }
 
 #ifdef _WIN32
@@ -1457,6 +4605,161 @@ extern "C" DLLEXPORT double print(double X)
   return 0;
 }
 
+// Memo tables aren't shared between threads: bases called from a parallel
+// for's chunks, or from spawned calls on the task pool's threads, neither
+// look up nor store results.
+extern "C" DLLEXPORT const double *pizza_memo_lookup(Pizza::MemoTable *Table,
+                                                     const double *Args)
+{
+  if (Pizza::WorkPool::inChunk() || Pizza::TaskPool::onWorker())
+    return nullptr;
+  return Table->lookup(Args);
+}
+
+extern "C" DLLEXPORT void pizza_memo_store(Pizza::MemoTable *Table, const double *Args,
+                                           double Value)
+{
+  if (!Pizza::WorkPool::inChunk() && !Pizza::TaskPool::onWorker())
+    Table->store(Args, Value);
+}
+
+// Started by the first spawn, unless spawns are all plain calls anyway.
+// Like the WorkPool it is never destroyed.
+static std::atomic<Pizza::TaskPool *> TheTaskPool;
+
+// Ends the program after an error in compiled code. In a parallel for, or
+// once calls were spawned, other threads may still be running compiled
+// code, which exit() would tear down under them, so only stdout is flushed.
+[[noreturn]] static void ExitFromCompiledCode()
+{
+  if (!Pizza::WorkPool::inChunk() && !TheTaskPool)
+    exit(1);
+  fflush(stdout);
+  _Exit(1);
+}
+
+// Storage of the array toppings; see EmitArenaAlloc. Each thread has its
+// own, so the chunks of a parallel for declare arrays independently.
+static thread_local Pizza::Arena TheArena;
+
+extern "C" DLLEXPORT void *pizza_arena_alloc(int64_t Count, int64_t Size)
+{
+  if (Count < 0)
+  {
+    fprintf(stderr, "Invalid array length\n");
+    ExitFromCompiledCode();
+  }
+  // Loop counters bounded by an array's length rely on this limit.
+  void *Ptr = Count <= Pizza::AST::IntegerTypes::MaxArrayLength && (uint64_t)Count <= SIZE_MAX / Size
+                  ? TheArena.allocate(Count * Size)
+                  : nullptr;
+  if (!Ptr)
+  {
+    fprintf(stderr, "Could not allocate an array of length %lld\n", (long long)Count);
+    ExitFromCompiledCode();
+  }
+  return Ptr;
+}
+
+extern "C" DLLEXPORT int64_t pizza_arena_mark()
+{
+  return TheArena.mark();
+}
+
+extern "C" DLLEXPORT void pizza_arena_release(int64_t Mark)
+{
+  TheArena.release(Mark);
+}
+
+extern "C" DLLEXPORT void pizza_bounds_error(int64_t Index, int64_t Length)
+{
+  fprintf(stderr, "Index %lld out of bounds for an array of length %lld\n",
+          (long long)Index, (long long)Length);
+  ExitFromCompiledCode();
+}
+
+// A parallel for: Body runs the loop with the counter going from its
+// second argument up to below its third, and returns the loop's value.
+struct ParallelLoop
+{
+  double (*Body)(void *, int64_t, int64_t);
+  void *Captures;
+  int64_t Start, Step;
+  uint64_t Iterations, Chunks;
+  double *Partials;
+};
+
+static void RunParallelChunk(void *Ctx, uint32_t Chunk)
+{
+  auto &L = *(ParallelLoop *)Ctx;
+  // The first Iterations % Chunks chunks run one iteration more.
+  uint64_t Size = L.Iterations / L.Chunks, Longer = L.Iterations % L.Chunks;
+  uint64_t First = Chunk * Size + std::min<uint64_t>(Chunk, Longer);
+  uint64_t End = First + Size + (Chunk < Longer);
+  L.Partials[Chunk] = L.Body(L.Captures, (int64_t)(L.Start + First * L.Step),
+                             (int64_t)(L.Start + End * L.Step));
+}
+
+// Started by the first parallel for. It is never destroyed: a runtime
+// error may end the program from one of its threads.
+static Pizza::WorkPool &GetWorkPool()
+{
+  static Pizza::WorkPool *Pool = new Pizza::WorkPool(std::thread::hardware_concurrency());
+  return *Pool;
+}
+
+// Runs the iterations from Start up to below Bound in chunks, storing
+// the value of each in Partials, and returns how many there were. A
+// parallel for in a chunk, or in a spawned call on one of the task pool's
+// threads, runs in that thread.
+extern "C" DLLEXPORT int64_t pizza_parallel_for(double (*Body)(void *, int64_t, int64_t),
+                                                void *Captures, int64_t Start, int64_t Bound,
+                                                int64_t Step, double *Partials)
+{
+  if (Start >= Bound)
+    return 0;
+  uint64_t Iterations = ((uint64_t)Bound - (uint64_t)Start - 1) / Step + 1;
+  ParallelLoop L = {Body, Captures, Start, Step, Iterations,
+                    std::min<uint64_t>(Iterations, MaxParallelChunks), Partials};
+  if (Pizza::WorkPool::inChunk() || Pizza::TaskPool::onWorker())
+  {
+    for (uint32_t Chunk = 0; Chunk < L.Chunks; Chunk++)
+      RunParallelChunk(&L, Chunk);
+  }
+  else
+    GetWorkPool().run(L.Chunks, RunParallelChunk, &L);
+  return L.Chunks;
+}
+
+static Pizza::TaskPool *StartTaskPool()
+{
+  unsigned Threads = std::thread::hardware_concurrency();
+  // By default, enough levels for about 16 calls per core, so the cores
+  // stay busy when the calls take uneven time.
+  unsigned Depth = spawnDepth >= 0 ? spawnDepth : Threads > 1 ? Log2_32_Ceil(Threads) + 4 : 0;
+  if (Depth)
+    TheTaskPool = new Pizza::TaskPool(Threads, Depth);
+  return TheTaskPool;
+}
+
+// Queues a spawned call, or returns 0 for the caller to make it itself. The
+// chunks of a parallel for have threads of their own, so calls spawned
+// there always run in place.
+extern "C" DLLEXPORT int32_t pizza_spawn(Pizza::TaskGroup *Group, Pizza::TaskPool::RunFn Run,
+                                         const void *Args, int64_t Size, void *Dest)
+{
+  if (Pizza::WorkPool::inChunk())
+    return 0;
+  static Pizza::TaskPool *Pool = StartTaskPool();
+  return Pool && Pool->spawn(*Group, Run, Args, Size, Dest);
+}
+
+// Only called once the group spawned something, so the pool exists.
+extern "C" DLLEXPORT void pizza_sync(Pizza::TaskGroup *Group)
+{
+  TheTaskPool.load()->sync(*Group);
+}
+
 extern "C" DLLEXPORT double printchar(double X)
 {
   if (replMode)
@@ -1474,28 +4777,40 @@ namespace Pizza
     int Run(const struct Options &opt)
     {
       replMode = opt.repl;
-      if (!replMode)
+      fastCompile = opt.fastCompile;
+      timeCompile = opt.timeCompile;
+      singlePrecision = opt.singlePrecision;
+      wholeProgram = opt.wholeProgram;
+      memoize = opt.memoize;
+      printStats = opt.stats;
+      emitBatch = opt.batch;
+      spawnDepth = opt.spawnDepth;
+      if (replMode)
+        Src = Pizza::Source::openStdin();
+      else
       {
-        srcFile = fopen(opt.srcPath.c_str(), "r");
-        if (srcFile == nullptr)
+        Src = Pizza::Source::openFile(opt.srcPath);
+        if (!Src)
         {
           fprintf(stderr, "Could not open file %s\n", opt.srcPath.c_str());
           return 1;
         }
       }
+      Lex = std::make_unique<Pizza::Lexer>(*Src, Symbols);
+
+      if (opt.benchLexer)
+        return BenchLexer();
 
       if (opt.jsonPath.size() > 0)
       {
-        jsonFile.open(opt.jsonPath, std::ios::trunc);
-        jsonFile << "{\"ast\":[\"start\"" << std::endl;
-        if (jsonFile.fail())
+        std::error_code EC;
+        jsonFile = std::make_unique<raw_fd_ostream>(opt.jsonPath, EC, sys::fs::OF_None);
+        if (EC)
         {
-          if (!replMode)
-            fclose(srcFile);
-
           fprintf(stderr, "Could not open file %s\n", opt.jsonPath.c_str());
           return 1;
         }
+        *jsonFile << "{\"ast\":[\"start\"\n";
       }
 
       if (opt.llPath.size() > 0)
@@ -1505,9 +4820,8 @@ namespace Pizza
 
         if (EC)
         {
-          if (!replMode)
-            fclose(srcFile);
-          jsonFile.close();
+          if (jsonFile)
+            jsonFile->close();
           errs() << "Could not open file: " << EC.message() << "\n";
           return 1;
         }
@@ -1523,21 +4837,51 @@ namespace Pizza
       BinopPrecedence['-'] = 20;
       BinopPrecedence['*'] = 40;
       BinopPrecedence['/'] = 40;
+      InternOperatorSymbols();
+      InternMathSauces();
+      for (const std::string &Name : opt.memoizeBases)
+        MemoizeBases.insert(Symbols.intern(Name));
+      if (!ParseTargetClones(opt.targetClones))
+        return 1;
+
+      if (opt.benchJson)
+        return BenchJSON();
 
       if (replMode)
         fprintf(stderr, "ready> ");
 
-      getNextToken();
-
-      TheJIT = ExitOnErr(Pizza::JIT::Create());
+      // --whole-program is about the optimizations across bases, so it
+      // defaults to -O2.
+      char OptLevel = opt.optLevel ? opt.optLevel : wholeProgram ? '2' : 0;
+      TheJIT = ExitOnErr(Pizza::JIT::Create(fastCompile ? CodeGenOpt::None : CodeGenOptLevel(OptLevel),
+                                            /*FastISel=*/fastCompile, opt.march, opt.mattr));
+      if (OptLevel)
+        TheMPM = std::make_unique<ModuleOptimizer>(ExitOnErr(TheJIT->createTargetMachine()),
+                                                   OptLevel, LoadVectorMathLibrary());
       InitializeModuleAndPassManager();
-      StoreNamedValues(); //avoid getting empty;
-      MainLoop();
+      auto Start = std::chrono::steady_clock::now();
+
+      if (!opt.astCacheDir.empty())
+        CachedMainLoop(opt.astCacheDir);
+      else if (opt.parallelParse)
+        ParallelMainLoop();
+      else
+      {
+        TheParser = std::make_unique<Parser>(Lex.get(), ASTTree, BinopPrecedence);
+        TheParser->getNextToken();
+        MainLoop();
+      }
+
+      if (wholeProgram)
+        EmitWholeProgram(Start);
+
+      if (printStats)
+        PrintStats();
 
       if (opt.jsonPath.size() > 0)
       {
-        jsonFile << ",\"end\"]}" << std::endl;
-        jsonFile.close();
+        *jsonFile << ",\"end\"]}\n";
+        jsonFile->close();
       }
 
       if (opt.llPath.size() > 0)
@@ -1545,8 +4889,6 @@ namespace Pizza
         llFile->close();
       }
 
-      fclose(srcFile);
-
       return 0;
     }
   }
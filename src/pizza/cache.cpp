@@ -0,0 +1,216 @@
+#include <cstring>
+#include <type_traits>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "pizza/cache.h"
+
+using namespace llvm;
+
+namespace
+{
+  using namespace Pizza;
+  using namespace Pizza::AST;
+
+  const char Magic[8] = {'P', 'I', 'Z', 'Z', 'A', 'A', 'S', 'T'};
+  const uint32_t ByteOrderMark = 0x01020304;
+
+  // The file is this header followed by these sections, each starting at a
+  // multiple of 8 bytes:
+  //   uint32_t NameEnds[NumSymbols]   end offset of each name in Names
+  //   char Names[NameBytes]
+  //   CachedItem Items[NumItems]
+  //   Symbol Args[NumArgs]
+  //   char Errors[ErrorBytes]
+  //   one array per Tree column, ColumnSizes[i] elements each
+  // Everything is in the writer's byte order and struct layout; ByteOrder and
+  // the version catch files from another build.
+  struct FileHeader
+  {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t ByteOrder;
+    CacheKey Key;
+    uint32_t NumSymbols;
+    uint32_t NameBytes;
+    uint32_t NumItems;
+    uint32_t NumArgs;
+    uint32_t ErrorBytes;
+    uint32_t ColumnSizes[Tree::NumColumns];
+  };
+
+  static_assert(std::is_trivially_copyable<CachedItem>::value &&
+                    std::is_trivially_copyable<NumberExpr>::value &&
+                    std::is_trivially_copyable<ForExpr>::value &&
+                    std::is_trivially_copyable<VarBinding>::value,
+                "cached structs are written as raw bytes");
+
+  void writeSection(raw_ostream &OS, const void *Data, size_t Size)
+  {
+    OS.write((const char *)Data, Size);
+    OS.write_zeros(alignTo(Size, 8) - Size);
+  }
+
+  // Walks the sections of a mapped file, failing once one would run past
+  // its end.
+  class SectionReader
+  {
+  private:
+    const char *Ptr;
+    const char *End;
+
+  public:
+    SectionReader(const char *Ptr, const char *End) : Ptr(Ptr), End(End) {}
+
+    template <typename T>
+    bool read(size_t Count, ArrayRef<T> &Out)
+    {
+      size_t Size = alignTo(sizeof(T) * Count, 8);
+      if ((size_t)(End - Ptr) < Size)
+        return false;
+      Out = ArrayRef<T>((const T *)Ptr, Count);
+      Ptr += Size;
+      return true;
+    }
+
+    bool atEnd() const { return Ptr == End; }
+  };
+}
+
+namespace Pizza
+{
+  namespace AST
+  {
+    void ASTCache::addItem(CachedItem Item, ArrayRef<Symbol> ItemArgs,
+                           StringRef ItemErrors)
+    {
+      Item.Args = ListRef{Args.push(ItemArgs), (uint32_t)ItemArgs.size()};
+      Item.Errors = ListRef{Errors.push(makeArrayRef(ItemErrors.data(), ItemErrors.size())),
+                            (uint32_t)ItemErrors.size()};
+      Items.push(Item);
+    }
+
+    bool ASTCache::write(StringRef Path, const CacheKey &Key,
+                         const SymbolTable &Symbols) const
+    {
+      FileHeader Header = {};
+      memcpy(Header.Magic, Magic, sizeof(Magic));
+      Header.Version = Version;
+      Header.ByteOrder = ByteOrderMark;
+      Header.Key = Key;
+      Header.NumSymbols = Symbols.size();
+      Header.NumItems = Items.items().size();
+      Header.NumArgs = Args.items().size();
+      Header.ErrorBytes = Errors.items().size();
+
+      std::vector<uint32_t> NameEnds;
+      std::string Names;
+      for (Symbol S = 0; S < Header.NumSymbols; S++)
+      {
+        Names += Symbols.name(S);
+        NameEnds.push_back(Names.size());
+      }
+      Header.NameBytes = Names.size();
+
+      unsigned Col = 0;
+      ASTTree.forEachColumn([&](const auto &C)
+                            { Header.ColumnSizes[Col++] = C.items().size(); });
+
+      int FD;
+      SmallString<128> TmpPath;
+      if (sys::fs::createUniqueFile(Path + "-%%%%%%.tmp", FD, TmpPath))
+        return false;
+
+      {
+        raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        writeSection(OS, &Header, sizeof(Header));
+        writeSection(OS, NameEnds.data(), NameEnds.size() * sizeof(uint32_t));
+        writeSection(OS, Names.data(), Names.size());
+        writeSection(OS, Items.items().data(), Items.items().size() * sizeof(CachedItem));
+        writeSection(OS, Args.items().data(), Args.items().size() * sizeof(Symbol));
+        writeSection(OS, Errors.items().data(), Errors.items().size());
+        ASTTree.forEachColumn([&](const auto &C)
+                              { writeSection(OS, C.items().data(), C.items().size() *
+                                                                       sizeof(C.items()[0])); });
+        OS.close();
+        if (OS.has_error())
+        {
+          OS.clear_error();
+          sys::fs::remove(TmpPath);
+          return false;
+        }
+      }
+
+      if (sys::fs::rename(TmpPath, Path))
+      {
+        sys::fs::remove(TmpPath);
+        return false;
+      }
+      return true;
+    }
+
+    std::unique_ptr<ASTCache> ASTCache::load(StringRef Path, const CacheKey &Key,
+                                             SymbolTable &Symbols)
+    {
+      auto Buf = MemoryBuffer::getFile(Path, -1, /*RequiresNullTerminator=*/false);
+      if (!Buf)
+        return nullptr;
+
+      const char *Start = (*Buf)->getBufferStart();
+      const char *End = (*Buf)->getBufferEnd();
+      if ((uintptr_t)Start % 8 || (size_t)(End - Start) < sizeof(FileHeader))
+        return nullptr;
+
+      const FileHeader &Header = *(const FileHeader *)Start;
+      if (memcmp(Header.Magic, Magic, sizeof(Magic)) ||
+          Header.Version != Version || Header.ByteOrder != ByteOrderMark ||
+          Header.Key.SourceHash != Key.SourceHash ||
+          Header.Key.SourceSize != Key.SourceSize ||
+          memcmp(Header.Key.Precedence, Key.Precedence, sizeof(Key.Precedence)))
+        return nullptr;
+
+      auto Cache = std::make_unique<ASTCache>();
+      SectionReader R(Start + alignTo(sizeof(FileHeader), 8), End);
+      ArrayRef<uint32_t> NameEnds;
+      ArrayRef<char> Names, Errors;
+      ArrayRef<CachedItem> Items;
+      ArrayRef<Symbol> Args;
+      if (!R.read(Header.NumSymbols, NameEnds) || !R.read(Header.NameBytes, Names) ||
+          !R.read(Header.NumItems, Items) || !R.read(Header.NumArgs, Args) ||
+          !R.read(Header.ErrorBytes, Errors))
+        return nullptr;
+
+      bool Valid = true;
+      unsigned Col = 0;
+      Cache->ASTTree.forEachColumn([&](auto &C)
+                                   {
+                                     typedef typename std::decay_t<decltype(C)>::value_type T;
+                                     ArrayRef<T> Nodes;
+                                     Valid = Valid && R.read(Header.ColumnSizes[Col++], Nodes);
+                                     C.view(Nodes);
+                                   });
+      if (!Valid || !R.atEnd())
+        return nullptr;
+
+      uint32_t NameBegin = 0;
+      for (Symbol S = 0; S < Header.NumSymbols; S++)
+      {
+        if (NameEnds[S] < NameBegin || NameEnds[S] > Header.NameBytes)
+          return nullptr;
+        StringRef Name(Names.data() + NameBegin, NameEnds[S] - NameBegin);
+        if (Symbols.intern(Name) != S)
+          return nullptr;
+        NameBegin = NameEnds[S];
+      }
+
+      Cache->Items.view(Items);
+      Cache->Args.view(Args);
+      Cache->Errors.view(Errors);
+      Cache->Buffer = std::move(*Buf);
+      return Cache;
+    }
+  }
+}
@@ -0,0 +1,352 @@
+#include <cstdint>
+#include <cstring>
+#include <stdio.h>
+
+#include <llvm/ADT/APFloat.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MathExtras.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pizza/lexer.h"
+
+using namespace llvm;
+
+namespace
+{
+  using namespace Pizza;
+
+  // Character classes, indexed by the unsigned byte value. Matches the C
+  // locale isspace/isalpha/isdigit the lexer used to call per byte.
+  enum CharClass : uint8_t
+  {
+    cc_space = 1,
+    cc_alpha = 2,
+    cc_digit = 4,
+    cc_number = 8, // [0-9.]
+  };
+
+  struct CharTable
+  {
+    uint8_t Class[256];
+  };
+
+  constexpr CharTable buildCharTable()
+  {
+    CharTable T{};
+    for (int C = 0; C < 256; ++C)
+    {
+      uint8_t K = 0;
+      if (C == ' ' || (C >= '\t' && C <= '\r'))
+        K |= cc_space;
+      if ((C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z'))
+        K |= cc_alpha;
+      if (C >= '0' && C <= '9')
+        K |= cc_digit | cc_number;
+      if (C == '.')
+        K |= cc_number;
+      T.Class[C] = K;
+    }
+    return T;
+  }
+
+  constexpr CharTable Chars = buildCharTable();
+
+  inline bool is(int C, uint8_t K)
+  {
+    return C != EOF && (Chars.Class[(unsigned char)C] & K);
+  }
+
+  // Keywords are resolved with a perfect hash over (length, first, last); the
+  // static_assert below fails the build if a new keyword collides.
+  struct Keyword
+  {
+    const char *Spelling;
+    size_t Length;
+    int Tok;
+  };
+
+  constexpr Keyword Keywords[] = {
+      {"base", 4, tok_base},
+      {"topping", 7, tok_topping},
+      {"sauce", 5, tok_sauce},
+      {"if", 2, tok_if},
+      {"then", 4, tok_then},
+      {"else", 4, tok_else},
+      {"for", 3, tok_for},
+      {"in", 2, tok_in},
+      {"binary", 6, tok_binary},
+      {"unary", 5, tok_unary},
+      {"spawn", 5, tok_spawn},
+      {"sync", 4, tok_sync},
+  };
+  constexpr size_t NumKeywords = sizeof(Keywords) / sizeof(Keywords[0]);
+  constexpr unsigned KeywordSlots = 64;
+
+  constexpr unsigned keywordHash(const char *S, size_t Len)
+  {
+    return (Len + 2 * (unsigned char)S[0] + (unsigned char)S[Len - 1]) &
+           (KeywordSlots - 1);
+  }
+
+  struct KeywordTable
+  {
+    int8_t Slot[KeywordSlots];
+    bool Perfect;
+  };
+
+  constexpr KeywordTable buildKeywordTable()
+  {
+    KeywordTable T{};
+    T.Perfect = true;
+    for (unsigned I = 0; I < KeywordSlots; ++I)
+      T.Slot[I] = -1;
+    for (size_t I = 0; I < NumKeywords; ++I)
+    {
+      unsigned H = keywordHash(Keywords[I].Spelling, Keywords[I].Length);
+      if (T.Slot[H] != -1)
+        T.Perfect = false;
+      T.Slot[H] = (int8_t)I;
+    }
+    return T;
+  }
+
+  constexpr KeywordTable KeywordIndex = buildKeywordTable();
+  static_assert(KeywordIndex.Perfect, "keyword hash has collisions");
+
+  int lookupKeyword(StringRef Id)
+  {
+    int I = KeywordIndex.Slot[keywordHash(Id.data(), Id.size())];
+    if (I < 0 || Keywords[I].Length != Id.size() ||
+        memcmp(Keywords[I].Spelling, Id.data(), Id.size()) != 0)
+      return tok_identifier;
+    return Keywords[I].Tok;
+  }
+
+  // Returns the first byte in [P, E) that is not whitespace.
+  const char *skipSpaces(const char *P, const char *E)
+  {
+#ifdef __SSE2__
+    const __m128i Space = _mm_set1_epi8(' ');
+    const __m128i Tab = _mm_set1_epi8('\t');
+    const __m128i CtlSpan = _mm_set1_epi8('\r' - '\t');
+    while (E - P >= 16)
+    {
+      __m128i V = _mm_loadu_si128((const __m128i *)P);
+      // '\t'..'\r' is a range check done as (V - '\t') <=u 4.
+      __m128i Ctl = _mm_sub_epi8(V, Tab);
+      Ctl = _mm_cmpeq_epi8(_mm_min_epu8(Ctl, CtlSpan), Ctl);
+      __m128i Sp = _mm_or_si128(_mm_cmpeq_epi8(V, Space), Ctl);
+      unsigned Mask = _mm_movemask_epi8(Sp);
+      if (Mask != 0xFFFF)
+        return P + countTrailingZeros(~Mask);
+      P += 16;
+    }
+#endif
+    while (P != E && is((unsigned char)*P, cc_space))
+      ++P;
+    return P;
+  }
+
+  // Returns the first '\n' or '\r' in [P, E), or E.
+  const char *skipToLineEnd(const char *P, const char *E)
+  {
+#ifdef __SSE2__
+    const __m128i LF = _mm_set1_epi8('\n');
+    const __m128i CR = _mm_set1_epi8('\r');
+    while (E - P >= 16)
+    {
+      __m128i V = _mm_loadu_si128((const __m128i *)P);
+      unsigned Mask = _mm_movemask_epi8(
+          _mm_or_si128(_mm_cmpeq_epi8(V, LF), _mm_cmpeq_epi8(V, CR)));
+      if (Mask)
+        return P + countTrailingZeros(Mask);
+      P += 16;
+    }
+#endif
+    while (P != E && *P != '\n' && *P != '\r')
+      ++P;
+    return P;
+  }
+
+  // Parses a [0-9.]+ token with strtod semantics (everything from the second
+  // '.' on is ignored). Values whose significand fits in 53 bits with at most
+  // 22 fractional digits are exact in one division; longer literals go
+  // through APFloat, which is still correctly rounded.
+  double parseNumber(const char *P, const char *E)
+  {
+    static const double Pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    const char *Start = P;
+    uint64_t Mantissa = 0;
+    unsigned Significant = 0;
+    unsigned FracDigits = 0;
+    bool SeenDot = false;
+    for (; P != E; ++P)
+    {
+      if (*P == '.')
+      {
+        if (SeenDot)
+          break;
+        SeenDot = true;
+        continue;
+      }
+      if (Mantissa || *P != '0')
+        ++Significant;
+      if (Significant <= 19)
+        Mantissa = Mantissa * 10 + (*P - '0');
+      if (SeenDot)
+        ++FracDigits;
+    }
+
+    if (Significant <= 19 && Mantissa <= (uint64_t(1) << 53) && FracDigits <= 22)
+      return (double)Mantissa / Pow10[FracDigits];
+
+    APFloat F(APFloat::IEEEdouble());
+    auto Status = F.convertFromString(StringRef(Start, P - Start),
+                                      APFloat::rmNearestTiesToEven);
+    if (!Status)
+    {
+      consumeError(Status.takeError());
+      return 0;
+    }
+    return F.convertToDouble();
+  }
+}
+
+namespace Pizza
+{
+  // Returns the character under CurPtr without consuming it, pulling in the
+  // next block of input when the current one is exhausted.
+  int Lexer::peekChar()
+  {
+    if (CurPtr == Src.end())
+    {
+      size_t Offset = CurPtr - TokStart;
+      bool More = Src.refill(TokStart);
+      CurPtr = TokStart + Offset;
+      if (!More)
+        return EOF;
+    }
+    return (unsigned char)*CurPtr;
+  }
+
+  // Skips whitespace and '#' comments a window at a time.
+  void Lexer::skipTrivia()
+  {
+    while (1)
+    {
+      CurPtr = skipSpaces(CurPtr, Src.end());
+      TokStart = CurPtr;
+      int C = peekChar();
+      if (C == EOF)
+        return;
+      if (is(C, cc_space))
+        continue;
+      if (C != '#')
+        return;
+
+      do
+      {
+        CurPtr = skipToLineEnd(CurPtr, Src.end());
+        TokStart = CurPtr;
+        C = peekChar();
+      } while (C != EOF && C != '\n' && C != '\r');
+    }
+  }
+
+  int Lexer::gettok()
+  {
+    skipTrivia();
+    int LastChar = peekChar();
+
+    if (is(LastChar, cc_alpha))
+    {
+      do
+        ++CurPtr;
+      while (is(peekChar(), cc_alpha | cc_digit));
+      StringRef Id(TokStart, CurPtr - TokStart);
+      int Tok = lookupKeyword(Id);
+      if (Tok == tok_identifier)
+        IdentifierSym = Symbols.intern(Id);
+      return Tok;
+    }
+
+    if (is(LastChar, cc_number))
+    { // Number: [0-9.]+
+      do
+        ++CurPtr;
+      while (is(peekChar(), cc_number));
+
+      NumVal = parseNumber(TokStart, CurPtr);
+      return tok_number;
+    }
+
+    // Check for end of file.  Don't eat the EOF.
+    if (LastChar == EOF)
+      return tok_eof;
+
+    // Otherwise, just return the character as its ascii value.
+    ++CurPtr;
+    return LastChar;
+  }
+
+  std::vector<const char *> splitTopLevelItems(const char *Begin, const char *End,
+                                               size_t MinSize)
+  {
+    std::vector<const char *> Ends;
+    const char *PieceStart = Begin;
+    unsigned Depth = 0;
+    const char *P = Begin;
+    while (P != End)
+    {
+      unsigned char C = *P;
+      if (is(C, cc_alpha))
+      {
+        const char *IdStart = P;
+        while (P != End && is((unsigned char)*P, cc_alpha | cc_digit))
+          ++P;
+        int Tok = lookupKeyword(StringRef(IdStart, P - IdStart));
+        if (Tok == tok_binary || Tok == tok_unary)
+        {
+          const char *Op = skipSpaces(P, End);
+          if (Op != End && *Op && strchr(";(){}", *Op))
+            return {End};
+        }
+        continue;
+      }
+
+      switch (C)
+      {
+      case '#':
+        P = skipToLineEnd(P, End);
+        continue;
+      case '(':
+      case '{':
+        ++Depth;
+        break;
+      case ')':
+      case '}':
+        if (Depth)
+          --Depth;
+        break;
+      case ';':
+        if (!Depth && P + 1 - PieceStart >= (ptrdiff_t)MinSize)
+        {
+          PieceStart = P + 1;
+          Ends.push_back(PieceStart);
+        }
+        break;
+      }
+      ++P;
+    }
+
+    if (Ends.empty() || Ends.back() != End)
+      Ends.push_back(End);
+    return Ends;
+  }
+}
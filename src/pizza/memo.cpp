@@ -0,0 +1,71 @@
+#include <cstring>
+
+#include "pizza/memo.h"
+
+namespace Pizza
+{
+  MemoTable::MemoTable(unsigned NumArgs)
+      : NumArgs(NumArgs), Keys((size_t)NumArgs << LogCapacity),
+        Values(size_t(1) << LogCapacity), Used(size_t(1) << LogCapacity) {}
+
+  // splitmix64's finalizer over each argument. Doubles that hold small
+  // integers differ only in their top bits, so those have to reach the low
+  // bits the slot index is taken from.
+  size_t MemoTable::hash(const double *Args) const
+  {
+    uint64_t H = NumArgs;
+    for (unsigned I = 0; I < NumArgs; I++)
+    {
+      uint64_t Bits;
+      memcpy(&Bits, &Args[I], sizeof(Bits));
+      H += Bits + 0x9E3779B97F4A7C15ull;
+      H = (H ^ (H >> 30)) * 0xBF58476D1CE4E5B9ull;
+      H = (H ^ (H >> 27)) * 0x94D049BB133111EBull;
+      H ^= H >> 31;
+    }
+    return H;
+  }
+
+  bool MemoTable::matches(size_t Slot, const double *Args) const
+  {
+    return memcmp(&Keys[Slot * NumArgs], Args, NumArgs * sizeof(double)) == 0;
+  }
+
+  const double *MemoTable::lookup(const double *Args)
+  {
+    Calls++;
+    size_t Mask = Values.size() - 1;
+    size_t H = hash(Args);
+    for (unsigned Probe = 0; Probe < MaxProbes; Probe++)
+    {
+      size_t Slot = (H + Probe) & Mask;
+      if (!Used[Slot])
+        return nullptr;
+      if (matches(Slot, Args))
+      {
+        Hits++;
+        return &Values[Slot];
+      }
+    }
+    return nullptr;
+  }
+
+  void MemoTable::store(const double *Args, double Value)
+  {
+    size_t Mask = Values.size() - 1;
+    size_t H = hash(Args);
+    size_t Slot = H & Mask;
+    for (unsigned Probe = 0; Probe < MaxProbes; Probe++)
+    {
+      size_t S = (H + Probe) & Mask;
+      if (!Used[S] || matches(S, Args))
+      {
+        Slot = S;
+        break;
+      }
+    }
+    memcpy(&Keys[Slot * NumArgs], Args, NumArgs * sizeof(double));
+    Values[Slot] = Value;
+    Used[Slot] = 1;
+  }
+}
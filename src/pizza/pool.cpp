@@ -0,0 +1,135 @@
+#include <algorithm>
+
+#include "pizza/pool.h"
+
+namespace Pizza
+{
+  static thread_local bool InChunk = false;
+
+  static uint64_t pack(uint32_t First, uint32_t End)
+  {
+    return (uint64_t)First << 32 | End;
+  }
+
+  WorkPool::WorkPool(unsigned Threads) : Shares(std::max(Threads, 1u))
+  {
+    for (unsigned I = 1; I < Shares.size(); I++)
+      Workers.emplace_back([this, I]
+                           { work(I); });
+  }
+
+  WorkPool::~WorkPool()
+  {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Stopping = true;
+    }
+    Started.notify_all();
+    for (std::thread &Worker : Workers)
+      Worker.join();
+  }
+
+  bool WorkPool::inChunk()
+  {
+    return InChunk;
+  }
+
+  void WorkPool::run(uint32_t NumChunks, ChunkFn Fn, void *Ctx)
+  {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      this->Fn = Fn;
+      this->Ctx = Ctx;
+      uint64_t Threads = Shares.size();
+      for (uint64_t I = 0; I < Threads; I++)
+        Shares[I].Range = pack(NumChunks * I / Threads, NumChunks * (I + 1) / Threads);
+      Loop++;
+      Running = Workers.size();
+    }
+    Started.notify_all();
+    runChunks(0);
+
+    // The last chunks may still be running on other threads.
+    std::unique_lock<std::mutex> Guard(Lock);
+    Finished.wait(Guard, [this]
+                  { return Running == 0; });
+  }
+
+  void WorkPool::work(unsigned Self)
+  {
+    uint64_t Seen = 0;
+    std::unique_lock<std::mutex> Guard(Lock);
+    while (1)
+    {
+      Started.wait(Guard, [&]
+                   { return Stopping || Loop != Seen; });
+      if (Stopping)
+        return;
+      Seen = Loop;
+      Guard.unlock();
+      runChunks(Self);
+      Guard.lock();
+      if (--Running == 0)
+        Finished.notify_one();
+    }
+  }
+
+  void WorkPool::runChunks(unsigned Self)
+  {
+    InChunk = true;
+    uint32_t Chunk;
+    while (next(Self, Chunk))
+      Fn(Ctx, Chunk);
+    InChunk = false;
+  }
+
+  bool WorkPool::next(unsigned Self, uint32_t &Chunk)
+  {
+    std::atomic<uint64_t> &Own = Shares[Self].Range;
+    while (1)
+    {
+      uint64_t Range = Own.load();
+      uint32_t First = Range >> 32, End = (uint32_t)Range;
+      if (First < End)
+      {
+        if (Own.compare_exchange_weak(Range, pack(First + 1, End)))
+        {
+          Chunk = First;
+          return true;
+        }
+        continue;
+      }
+
+      // Nothing left here, so steal from whoever has the most left. A share
+      // that looks empty may be one a thief is about to refill, but the
+      // thief runs those chunks itself.
+      unsigned Victim = Self;
+      uint64_t VictimRange = 0;
+      uint32_t Most = 0;
+      for (unsigned I = 1; I < Shares.size(); I++)
+      {
+        unsigned Other = (Self + I) % Shares.size();
+        uint64_t R = Shares[Other].Range.load();
+        uint32_t F = R >> 32, E = (uint32_t)R;
+        if (F < E && E - F > Most)
+        {
+          Victim = Other;
+          VictimRange = R;
+          Most = E - F;
+        }
+      }
+      if (Victim == Self)
+        return false;
+
+      // The thief takes [Split, End), running Split right away. If the
+      // victim took a chunk meanwhile the exchange fails and we look again.
+      uint32_t VictimFirst = VictimRange >> 32, VictimEnd = (uint32_t)VictimRange;
+      uint32_t Split = VictimEnd - (Most + 1) / 2;
+      if (!Shares[Victim].Range.compare_exchange_strong(VictimRange, pack(VictimFirst, Split)))
+        continue;
+      Own = pack(Split + 1, VictimEnd);
+      Chunk = Split;
+      return true;
+    }
+  }
+}
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cstring>
+
+#include <llvm/Support/FileSystem.h>
+
+#include "pizza/source.h"
+
+using namespace llvm;
+
+namespace Pizza
+{
+  // std::max takes its arguments by reference, which needs a definition.
+  const size_t Source::BlockSize;
+  const size_t Source::LineBlockSize;
+
+  std::unique_ptr<Source> Source::openFile(const std::string &Path)
+  {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf)
+      return nullptr;
+
+    auto Src = std::make_unique<Source>();
+    Src->File = std::move(*Buf);
+    Src->Begin = Src->File->getBufferStart();
+    Src->End = Src->File->getBufferEnd();
+    Src->AtEOF = true;
+    return Src;
+  }
+
+  std::unique_ptr<Source> Source::openStdin()
+  {
+    auto Src = std::make_unique<Source>();
+    static const char Empty[1] = {'\0'};
+    Src->Begin = Empty;
+    Src->End = Empty;
+    return Src;
+  }
+
+  std::unique_ptr<Source> Source::openRange(const char *Begin, const char *End)
+  {
+    auto Src = std::make_unique<Source>();
+    Src->Begin = Begin;
+    Src->End = End;
+    Src->AtEOF = true;
+    return Src;
+  }
+
+  bool Source::refill(const char *&Keep)
+  {
+    if (AtEOF)
+      return false;
+
+    // Line-at-a-time reads from a terminal get a small block; it only grows
+    // to BlockSize once a read fills all the room it was given.
+    size_t Carry = End - Keep;
+    size_t Capacity = std::max(LastReadFull ? BlockSize : LineBlockSize, 2 * Carry);
+    if (Capacity > BlockCapacity)
+    {
+      std::unique_ptr<char[]> Grown(new char[Capacity + 1]);
+      memcpy(Grown.get(), Keep, Carry);
+      Block = std::move(Grown);
+      BlockCapacity = Capacity;
+    }
+    else
+      memmove(Block.get(), Keep, Carry);
+
+    size_t Room = BlockCapacity - Carry;
+    auto Read = sys::fs::readNativeFile(sys::fs::getStdinHandle(),
+                                        MutableArrayRef<char>(Block.get() + Carry, Room));
+    size_t Got = Read ? *Read : 0;
+    consumeError(Read.takeError());
+    LastReadFull = Got == Room;
+
+    Begin = Block.get();
+    End = Begin + Carry + Got;
+    Block[Carry + Got] = '\0';
+    Keep = Begin;
+    if (Got == 0)
+    {
+      AtEOF = true;
+      return false;
+    }
+    return true;
+  }
+}
@@ -0,0 +1,37 @@
+#include <cassert>
+
+#include "pizza/symbols.h"
+
+using namespace llvm;
+
+namespace Pizza
+{
+  Symbol SymbolTable::intern(StringRef Name)
+  {
+    {
+      sys::SmartScopedReader<true> Lock(Mutex);
+      auto It = Ids.find(Name);
+      if (It != Ids.end())
+        return It->second;
+    }
+
+    sys::SmartScopedWriter<true> Lock(Mutex);
+    auto Inserted = Ids.try_emplace(Name, (Symbol)Names.size());
+    if (Inserted.second)
+      Names.push_back(Inserted.first->first());
+    return Inserted.first->second;
+  }
+
+  StringRef SymbolTable::name(Symbol S) const
+  {
+    sys::SmartScopedReader<true> Lock(Mutex);
+    assert(S < Names.size() && "unknown symbol");
+    return Names[S];
+  }
+
+  size_t SymbolTable::size() const
+  {
+    sys::SmartScopedReader<true> Lock(Mutex);
+    return Names.size();
+  }
+}
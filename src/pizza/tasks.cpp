@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "pizza/tasks.h"
+
+namespace Pizza
+{
+  // The calling thread's index in the pool, or -1 for threads outside it.
+  static thread_local int Self = -1;
+  // How many spawns deep the calling thread is.
+  static thread_local int64_t Depth = 0;
+  static thread_local uint32_t Random = 1;
+
+  // How often an idle worker looks for queued calls before it sleeps.
+  static const unsigned SpinRounds = 64;
+
+  bool TaskPool::Deque::push(Task *T)
+  {
+    int64_t B = Bottom.load(std::memory_order_relaxed);
+    if (B - Top.load(std::memory_order_acquire) >= Capacity)
+      return false;
+    Slots[B % Capacity].store(T, std::memory_order_relaxed);
+    // Thieves read Bottom before the slot, so this publishes the task.
+    Bottom.store(B + 1, std::memory_order_release);
+    return true;
+  }
+
+  TaskPool::Task *TaskPool::Deque::pop()
+  {
+    int64_t B = Bottom.load(std::memory_order_relaxed) - 1;
+    Bottom.store(B, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t T = Top.load(std::memory_order_relaxed);
+    if (T > B)
+    {
+      Bottom.store(B + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    Task *Popped = Slots[B % Capacity].load(std::memory_order_relaxed);
+    if (T == B)
+    {
+      // The last task, which a thief may be taking as well.
+      if (!Top.compare_exchange_strong(T, T + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed))
+        Popped = nullptr;
+      Bottom.store(B + 1, std::memory_order_relaxed);
+    }
+    return Popped;
+  }
+
+  TaskPool::Task *TaskPool::Deque::steal()
+  {
+    int64_t T = Top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t B = Bottom.load(std::memory_order_acquire);
+    if (T >= B)
+      return nullptr;
+    // If the exchange fails the owner or another thief got the task.
+    Task *Stolen = Slots[T % Capacity].load(std::memory_order_relaxed);
+    if (!Top.compare_exchange_strong(T, T + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed))
+      return nullptr;
+    return Stolen;
+  }
+
+  bool TaskPool::Deque::empty() const
+  {
+    return Top.load(std::memory_order_acquire) >= Bottom.load(std::memory_order_acquire);
+  }
+
+  TaskPool::TaskPool(unsigned Threads, unsigned MaxDepth) : MaxDepth(MaxDepth)
+  {
+    Threads = std::max(Threads, 1u);
+    for (unsigned I = 0; I < Threads; I++)
+      Deques.push_back(std::make_unique<Deque>());
+    Self = 0;
+    for (unsigned I = 1; I < Threads; I++)
+      Workers.emplace_back([this, I]
+                           { work(I); });
+  }
+
+  TaskPool::~TaskPool()
+  {
+    Stopping = true;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Epoch++;
+    }
+    Woken.notify_all();
+    for (std::thread &Worker : Workers)
+      Worker.join();
+  }
+
+  bool TaskPool::onWorker()
+  {
+    return Self > 0;
+  }
+
+  bool TaskPool::spawn(TaskGroup &Group, RunFn Run, const void *Args, size_t Size, void *Dest)
+  {
+    if (Self < 0 || Depth >= MaxDepth)
+      return false;
+
+    Task *T = new (::operator new(sizeof(Task) + Size)) Task{Run, Dest, &Group, Depth + 1};
+    memcpy(T->args(), Args, Size);
+    Group.Pending.fetch_add(1, std::memory_order_relaxed);
+    if (!Deques[Self]->push(T))
+    {
+      Group.Pending.fetch_sub(1, std::memory_order_relaxed);
+      ::operator delete(T);
+      return false;
+    }
+    if (Group.Entry < 0)
+      Group.Entry = Depth;
+    Depth++;
+
+    // Pairs with the fence in work(): either a worker going to sleep sees
+    // the task, or this sees the worker and wakes one.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (Sleeping.load(std::memory_order_relaxed))
+    {
+      {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Epoch++;
+      }
+      Woken.notify_one();
+    }
+    return true;
+  }
+
+  void TaskPool::sync(TaskGroup &Group)
+  {
+    if (Group.Entry < 0)
+      return;
+    Deque &Own = *Deques[Self];
+    while (Group.Pending.load(std::memory_order_acquire) != 0)
+    {
+      // Whatever Group left on our deque is at the bottom, above the calls
+      // of the bases further up the stack, which have to wait their turn.
+      if (Task *T = Own.pop())
+      {
+        if (T->Group == &Group)
+        {
+          run(T);
+          continue;
+        }
+        Own.push(T);
+      }
+      // The rest were stolen; help with other calls until they are done.
+      if (Task *T = stealAny())
+        run(T);
+      else
+        std::this_thread::yield();
+    }
+    Depth = Group.Entry;
+    Group.Entry = -1;
+  }
+
+  void TaskPool::run(Task *T)
+  {
+    int64_t Outer = Depth;
+    Depth = T->Depth;
+    T->Run(T->args(), T->Dest);
+    Depth = Outer;
+    TaskGroup *Group = T->Group;
+    ::operator delete(T);
+    // The spawner may return, and its frame go away, as soon as this lands.
+    Group->Pending.fetch_sub(1, std::memory_order_release);
+  }
+
+  TaskPool::Task *TaskPool::stealAny()
+  {
+    // Starting from a random victim keeps thieves from all going for the
+    // same deque.
+    Random ^= Random << 13;
+    Random ^= Random >> 17;
+    Random ^= Random << 5;
+    unsigned Count = Deques.size();
+    for (unsigned I = 0; I < Count; I++)
+    {
+      unsigned Victim = (Random + I) % Count;
+      if (Victim == (unsigned)Self)
+        continue;
+      if (Task *T = Deques[Victim]->steal())
+        return T;
+    }
+    return nullptr;
+  }
+
+  bool TaskPool::anyQueued() const
+  {
+    for (auto &D : Deques)
+      if (!D->empty())
+        return true;
+    return false;
+  }
+
+  void TaskPool::work(unsigned Index)
+  {
+    Self = Index;
+    Random = Index * 2654435761u;
+    while (!Stopping)
+    {
+      if (Task *T = stealAny())
+      {
+        run(T);
+        continue;
+      }
+
+      // Spawns come in bursts, so look again for a while before sleeping.
+      bool Queued = false;
+      for (unsigned Round = 0; Round < SpinRounds && !Queued; Round++)
+      {
+        std::this_thread::yield();
+        Queued = anyQueued();
+      }
+      if (Queued)
+        continue;
+
+      uint64_t Seen;
+      {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Seen = Epoch;
+      }
+      Sleeping.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!anyQueued())
+      {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Woken.wait(Guard, [&]
+                   { return Epoch != Seen || Stopping; });
+      }
+      Sleeping.fetch_sub(1);
+    }
+  }
+}
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <cmath>
+
+#include "pizza/types.h"
+
+using namespace llvm;
+
+namespace Pizza
+{
+  namespace AST
+  {
+    // Resolves names the way codegen does, creating a Binding for every
+    // variable and a Constraint for every value stored into one.
+    class IntegerTypes::Collector : public ExprVisitor<Collector>
+    {
+    private:
+      IntegerTypes &R;
+      ScopedSymbolTable<Binding *> Scope;
+      // What an array's name evaluates to: its length, always an integer.
+      Binding *ArrayLength = nullptr;
+
+      Binding *newBinding(bool Int, double Bound = 0)
+      {
+        R.Bindings.push_back({Int, Bound, false});
+        return &R.Bindings.back();
+      }
+
+      Binding *newSite(ExprRef Site, unsigned Index)
+      {
+        Binding *B = newBinding(true);
+        R.Sites[siteKey(Site, Index)] = B;
+        return B;
+      }
+
+      void constrain(Binding *Target, ExprRef Value, ExprRef Loop = ExprRef())
+      {
+        R.Constraints.push_back({Target, Value, Loop});
+      }
+
+    public:
+      explicit Collector(IntegerTypes &R) : ExprVisitor(*R.T), R(R) {}
+
+      void collect(ArrayRef<Symbol> Params, ExprRef Body)
+      {
+        Scope.enterScope();
+        ArrayLength = newBinding(true, (double)MaxArrayLength);
+        Binding *Param = newBinding(false);
+        for (Symbol Name : Params)
+          if (!Scope.lookup(Name))
+            Scope.bind(Name, Param);
+        visit(Body);
+        Scope.exitScope();
+      }
+
+      void visitVariable(ExprRef E, const VariableExpr &N)
+      {
+        if (Binding *B = Scope.lookup(N.Name))
+          R.Refs[E.getRaw()] = B;
+      }
+
+      void visitBinary(ExprRef E, const BinaryExpr &N)
+      {
+        if (N.Op != '=')
+        {
+          visitExpr(E);
+          return;
+        }
+        if (N.LHS.getKind() != ExprKind::Variable)
+        {
+          visitExpr(E);
+          return;
+        }
+        visit(N.RHS);
+        Binding *B = Scope.lookup(T.get<VariableExpr>(N.LHS).Name);
+        if (B && B != ArrayLength)
+        {
+          R.Refs[E.getRaw()] = B;
+          R.Refs[N.LHS.getRaw()] = B;
+          B->Assigned = true;
+          constrain(B, N.RHS);
+        }
+      }
+
+      void visitFor(ExprRef E, const ForExpr &N)
+      {
+        Scope.enterScope();
+        visit(N.Start);
+        Binding *B = newSite(E, 0);
+        Scope.bind(N.VarName, B);
+        constrain(B, N.Start);
+        constrain(B, N.Step, E);
+        visit(N.Body);
+        if (N.Step)
+          visit(N.Step);
+        visit(N.End);
+        Scope.exitScope();
+      }
+
+      void visitVar(ExprRef E, const VarExpr &N)
+      {
+        unsigned Index = 0;
+        for (const auto &VB : T.getBindings(N.Bindings))
+        {
+          if (VB.Length)
+          {
+            visit(VB.Length);
+            Index++;
+            Scope.bind(VB.Name, ArrayLength);
+            continue;
+          }
+          if (VB.Init)
+            visit(VB.Init);
+          Binding *B = newSite(E, Index++);
+          if (VB.Init)
+            constrain(B, VB.Init);
+          Scope.bind(VB.Name, B);
+        }
+        if (N.Body)
+          visit(N.Body);
+      }
+
+      void visitScope(ExprRef E, const ScopeExpr &)
+      {
+        Scope.enterScope();
+        visitExpr(E);
+        Scope.exitScope();
+      }
+    };
+
+    // The magnitude of an integer literal, or -1 if it isn't one that fits.
+    double IntegerTypes::literalBound(ExprRef E) const
+    {
+      if (E.getKind() != ExprKind::Number)
+        return -1;
+      double V = T->get<NumberExpr>(E).Val;
+      if (V != std::trunc(V) || std::fabs(V) > MaxExact)
+        return -1;
+      return std::fabs(V);
+    }
+
+    double IntegerTypes::refBound(ExprRef E) const
+    {
+      Binding *B = Refs.lookup(E.getRaw());
+      return B && B->Int ? B->Bound : -1;
+    }
+
+    // The largest magnitude E can have if it evaluates to an i64 under the
+    // current binding types, or -1 if it doesn't. While solving, children
+    // are bounded recursively; once the types are Final they have already
+    // been recorded.
+    double IntegerTypes::bound(ExprRef E, bool Final) const
+    {
+      auto Child = [&](ExprRef C)
+      {
+        if (!Final)
+          return bound(C, false);
+        auto It = IntExprs.find(C.getRaw());
+        return It == IntExprs.end() ? -1 : It->second;
+      };
+      // Arithmetic is only exact while its operands and result are.
+      auto Exact = [&](double B)
+      { return B <= MaxExact ? B : -1; };
+
+      switch (E.getKind())
+      {
+      case ExprKind::Number:
+        return literalBound(E);
+      case ExprKind::Variable:
+        return refBound(E);
+      case ExprKind::Binary:
+      {
+        auto &N = T->get<BinaryExpr>(E);
+        if (N.Op == '=')
+          return refBound(E);
+        if (N.Op != '+' && N.Op != '-' && N.Op != '<')
+          return -1;
+        double L = Exact(Child(N.LHS));
+        double R = L < 0 ? -1 : Exact(Child(N.RHS));
+        if (R < 0)
+          return -1;
+        return N.Op == '<' ? 1 : Exact(L + R);
+      }
+      case ExprKind::If:
+      {
+        auto &N = T->get<IfExpr>(E);
+        double Then = Child(N.Then);
+        double Else = Then < 0 ? -1 : Child(N.Else);
+        return Else < 0 ? -1 : std::max(Then, Else);
+      }
+      case ExprKind::Var:
+      {
+        auto &N = T->get<VarExpr>(E);
+        if (N.Body)
+          return Child(N.Body);
+        Binding *B = Sites.lookup(siteKey(E, N.Bindings.Size - 1));
+        return B && B->Int ? B->Bound : -1;
+      }
+      case ExprKind::Scope:
+      {
+        auto Body = T->getList(T->get<ScopeExpr>(E).Body);
+        return Body.empty() ? -1 : Child(Body.back());
+      }
+      default:
+        return -1;
+      }
+    }
+
+    // Bounds the values a loop variable steps to. The body only runs while
+    // i < X, so i + Step stays below X + Step; a body that assigns i starts
+    // the step from that value instead, which the bound of i covers. A
+    // parallel for's iterations are counted up front, so its body only sees
+    // the values below X.
+    double IntegerTypes::loopBound(const Constraint &C) const
+    {
+      auto &N = T->get<ForExpr>(C.Loop);
+      double Step = 1;
+      if (C.Value)
+      {
+        Step = literalBound(C.Value);
+        // '<' only ends a loop that grows.
+        if (Step < 0 || T->get<NumberExpr>(C.Value).Val < 0)
+          return -1;
+      }
+
+      if (N.End.getKind() != ExprKind::Binary)
+        return -1;
+      auto &Cmp = T->get<BinaryExpr>(N.End);
+      if (Cmp.Op != '<' || Cmp.LHS.getKind() != ExprKind::Variable ||
+          Refs.lookup(Cmp.LHS.getRaw()) != C.Target)
+        return -1;
+      double X = bound(Cmp.RHS, false);
+      if (X < 0)
+      {
+        if (!N.Parallel)
+          return -1;
+        X = (double)ParallelBound;
+      }
+      double Last = std::max(X - 1, C.Target->Assigned ? C.Target->Bound : 0.0);
+      return N.Parallel ? Last : Last + Step;
+    }
+
+    void IntegerTypes::record(ExprRef E)
+    {
+      T->forEachChild(E, [this](ExprRef C)
+                      { record(C); });
+      double B = bound(E, /*Final=*/true);
+      if (B >= 0)
+        IntExprs[E.getRaw()] = B;
+    }
+
+    void IntegerTypes::run(const Tree &Nodes, ArrayRef<Symbol> Params, ExprRef Body, double MaxExact)
+    {
+      T = &Nodes;
+      this->MaxExact = MaxExact;
+      Bindings.clear();
+      Constraints.clear();
+      Refs.clear();
+      Sites.clear();
+      IntExprs.clear();
+
+      Collector(*this).collect(Params, Body);
+
+      // Every variable starts out integral with a bound of 0. Bounds grow to
+      // cover each value stored, and a variable is demoted when one isn't
+      // integral or its bound passes MaxExact, until nothing changes. A
+      // bound fed only by other bounds settles within one pass per binding;
+      // one still growing after that feeds on itself and is demoted too.
+      unsigned Passes = 0;
+      bool Changed;
+      do
+      {
+        Changed = false;
+        Passes++;
+        for (auto &C : Constraints)
+        {
+          if (!C.Target->Int)
+            continue;
+          double B = C.Loop ? loopBound(C) : bound(C.Value, false);
+          // A parallel for counts in i64 whatever its bound.
+          bool Parallel = C.Loop && T->get<ForExpr>(C.Loop).Parallel;
+          if (B < 0 || (B > MaxExact && !Parallel) || (B > C.Target->Bound && Passes > Bindings.size()))
+          {
+            C.Target->Int = false;
+            Changed = true;
+          }
+          else if (B > C.Target->Bound)
+          {
+            C.Target->Bound = B;
+            Changed = true;
+          }
+        }
+      } while (Changed);
+
+      record(Body);
+    }
+  }
+}